@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include "ChunkMap.h"
+#include "FreeBlockLList.h"
+#include "FreeBlockRecord.h"
+
+#define CHUNK_MAP_SLOTS ((size_t) 1 << CHUNK_MAP_LEVEL_BITS)
+#define CHUNK_MAP_PAGES ((uintptr_t) 1 << (3 * CHUNK_MAP_LEVEL_BITS))
+
+struct Chunk_Map_Node
+{
+    void *slots[CHUNK_MAP_SLOTS];    //child nodes, or in a leaf the LListRecord owning each page
+};
+
+static struct Chunk_Map_Node root;
+
+//Level 2 indexes the root, level 0 a leaf
+static inline size_t Slot_Of(uintptr_t page, int level)
+{
+    return (page >> (level * CHUNK_MAP_LEVEL_BITS)) & (CHUNK_MAP_SLOTS - 1);
+}
+
+//The leaf covering page. With create set, missing nodes on the way down are mapped, which only the lock holder may do
+static inline struct Chunk_Map_Node *Find_Leaf(uintptr_t page, bool create)
+{
+    struct Chunk_Map_Node *node = &root;
+    for(int level = 2; level > 0; level--)
+    {
+        void **slot = &node->slots[Slot_Of(page, level)];
+        struct Chunk_Map_Node *child = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if(!child)
+        {
+            if(!create) return NULL;
+            child = mmap(NULL, sizeof(struct Chunk_Map_Node), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(child == MAP_FAILED) return NULL;
+            __atomic_store_n(slot, child, __ATOMIC_RELEASE);    //already zeroed by mmap when a reader first sees it
+        }
+        node = child;
+    }
+    return node;
+}
+
+static void Set_Pages(uintptr_t first, uintptr_t last, struct LListRecord *llist)
+{
+    struct Chunk_Map_Node *leaf = NULL;
+    for(uintptr_t page = first; page <= last; page++)
+    {
+        if(!leaf || Slot_Of(page, 0) == 0) leaf = Find_Leaf(page, false);
+        __atomic_store_n(&leaf->slots[Slot_Of(page, 0)], llist, __ATOMIC_RELEASE);    //llist is initialised by now
+    }
+}
+
+bool Chunk_Map_Insert(struct LListRecord *llist, void *start, size_t length)
+{
+    uintptr_t first = (uintptr_t) start >> CHUNK_MAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t) start + length - 1) >> CHUNK_MAP_PAGE_SHIFT;
+    if(last >= CHUNK_MAP_PAGES) return false;
+
+    //Every leaf first, so a failed mmap leaves no page half recorded
+    for(uintptr_t page = first; page <= last; page += CHUNK_MAP_SLOTS - Slot_Of(page, 0))
+        if(!Find_Leaf(page, true)) return false;
+    Set_Pages(first, last, llist);
+    return true;
+}
+
+void Chunk_Map_Remove(void *start, size_t length)
+{
+    Set_Pages((uintptr_t) start >> CHUNK_MAP_PAGE_SHIFT, ((uintptr_t) start + length - 1) >> CHUNK_MAP_PAGE_SHIFT, NULL);
+}
+
+struct LListRecord *Chunk_Of_Block(const void *fbr)
+{
+    uintptr_t page = (uintptr_t) fbr >> CHUNK_MAP_PAGE_SHIFT;
+    if(page >= CHUNK_MAP_PAGES) return NULL;
+    struct Chunk_Map_Node *leaf = Find_Leaf(page, false);
+    if(!leaf) return NULL;
+    struct LListRecord *llist = __atomic_load_n(&leaf->slots[Slot_Of(page, 0)], __ATOMIC_ACQUIRE);
+    if(!llist) return NULL;
+
+    //The chunk's pages also hold its LListRecord and the slop past the last granule
+    const void *block_start = (const void*) llist + sizeof(struct LListRecord);
+    const void *block_end = (const void*) llist + llist->size_of_mmap_chunk - sizeof(struct FreeBlockRecord);
+    return block_start <= fbr && fbr <= block_end ? llist : NULL;
+}
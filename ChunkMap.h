@@ -0,0 +1,23 @@
+#ifndef CHUNKMAP_H
+#define CHUNKMAP_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct LListRecord;
+
+//Which chunk each page of the heap belongs to, as a three level radix tree over the 48 bit user address space,
+//laid out like a page table. free looks pointers up here instead of walking llists, and the caches use it to
+//turn away pointers that are not ours before they read any header. Nodes are mmapped on first use and never
+//given back. Insert and remove run with the heap lock held; lookups need no lock at all
+
+#define CHUNK_MAP_PAGE_SHIFT 12
+#define CHUNK_MAP_LEVEL_BITS 12    //4096 slots, 32KB per node. A leaf covers 16MB of address space
+
+//Returns false if a node could not be mapped, with nothing recorded
+bool Chunk_Map_Insert(struct LListRecord *llist, void *start, size_t length);
+void Chunk_Map_Remove(void *start, size_t length);
+//The chunk whose block area holds the header at fbr, or NULL if there is none
+struct LListRecord *Chunk_Of_Block(const void *fbr);
+
+#endif
@@ -0,0 +1,147 @@
+#include "FreeBlockIndex.h"
+#include "FreeBlockLList.h"
+#include "FreeBlockRecord.h"
+#include "util.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void Index_Clear(struct Free_Block_Index *index)
+{
+    index->count = 0;
+    index->overflowed = false;
+}
+
+//Position of the first entry at or past offset
+static uint32_t Lower_Bound(const struct Free_Block_Index *index, uint32_t offset)
+{
+    uint32_t low = 0, high = index->count;
+    while(low < high)
+    {
+        uint32_t middle = (low + high) / 2;
+        if(index->offsets[middle] < offset) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+//Position of record's entry, which must be there
+static uint32_t Position_Of(const struct Free_Block_Index *index, uint32_t offset)
+{
+    uint32_t n = Lower_Bound(index, offset);
+    die_if_false(n < index->count && index->offsets[n] == offset, "Free block index: record is not in the index\n");
+    return n;
+}
+
+void Index_Insert(struct LListRecord *llist, struct FreeBlockRecord *record)
+{
+    struct Free_Block_Index *index = &llist->index;
+    if(index->overflowed) return;
+    if(index->count == FREE_INDEX_CAPACITY)
+    {
+        index->overflowed = true;
+        return;
+    }
+
+    uint32_t offset = FBR_To_Offset(llist, record);
+    uint32_t n = Lower_Bound(index, offset);
+    for(uint32_t m = index->count; m > n; m--)
+    {
+        index->granules[m] = index->granules[m - 1];
+        index->offsets[m] = index->offsets[m - 1];
+    }
+    index->granules[n] = record->data_granules;
+    index->offsets[n] = offset;
+    index->count++;
+}
+
+void Index_Remove(struct LListRecord *llist, struct FreeBlockRecord *record)
+{
+    struct Free_Block_Index *index = &llist->index;
+    if(index->overflowed) return;
+
+    uint32_t n = Position_Of(index, FBR_To_Offset(llist, record));
+    index->count--;
+    for(; n < index->count; n++)
+    {
+        index->granules[n] = index->granules[n + 1];
+        index->offsets[n] = index->offsets[n + 1];
+    }
+}
+
+void Index_Resize(struct LListRecord *llist, struct FreeBlockRecord *record)
+{
+    struct Free_Block_Index *index = &llist->index;
+    if(index->overflowed) return;
+    index->granules[Position_Of(index, FBR_To_Offset(llist, record))] = record->data_granules;
+}
+
+#ifdef DEBUG
+static void Index_Check(struct LListRecord *llist)
+{
+    uint32_t n = 0;
+    for(struct FreeBlockRecord *record = llist->head; record; record = Get_Next(record, llist), n++)
+    {
+        die_if_false(n < llist->index.count, "Free block index: fewer entries than blocks\n");
+        die_if_false(llist->index.offsets[n] == FBR_To_Offset(llist, record), "Free block index: offset out of step\n");
+        die_if_false(llist->index.granules[n] == record->data_granules, "Free block index: size out of step\n");
+    }
+    die_if_false(n == llist->index.count, "Free block index: more entries than blocks\n");
+}
+#endif
+
+bool Index_Usable(struct LListRecord *llist)
+{
+    struct Free_Block_Index *index = &llist->index;
+    if(index->overflowed)
+    {
+        if(llist->length > FREE_INDEX_CAPACITY / 2) return false;    //only rebuild with room to grow, or we would thrash
+        index->count = 0;
+        for(struct FreeBlockRecord *record = llist->head; record; record = Get_Next(record, llist))
+        {
+            index->granules[index->count] = record->data_granules;
+            index->offsets[index->count] = FBR_To_Offset(llist, record);
+            index->count++;
+        }
+        index->overflowed = false;
+    }
+#ifdef DEBUG
+    Index_Check(llist);
+#endif
+    return true;
+}
+
+//Sizes are unsigned, but SSE2 and AVX2 only compare signed integers. Flipping the top bit of both sides
+//maps the unsigned order onto the signed one
+int Index_Find_From(const struct Free_Block_Index *index, size_t size, int start)
+{
+    uint32_t granules = (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+    if(granules == 0) granules = 1;
+    uint32_t n = start;
+
+#if defined(__AVX2__)
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    const __m256i wanted = _mm256_set1_epi32((int32_t) ((granules - 1) ^ 0x80000000u));
+    for(; n + 8 <= index->count; n += 8)
+    {
+        __m256i sizes = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) &index->granules[n]), bias);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sizes, wanted)));
+        if(mask) return n + __builtin_ctz(mask);
+    }
+#elif defined(__SSE2__)
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i wanted = _mm_set1_epi32((int32_t) ((granules - 1) ^ 0x80000000u));
+    for(; n + 4 <= index->count; n += 4)
+    {
+        __m128i sizes = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &index->granules[n]), bias);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(sizes, wanted)));
+        if(mask) return n + __builtin_ctz(mask);
+    }
+#endif
+    for(; n < index->count; n++)
+        if(index->granules[n] >= granules) return n;
+    return -1;
+}
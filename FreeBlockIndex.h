@@ -0,0 +1,36 @@
+#ifndef FREEBLOCKINDEX_H
+#define FREEBLOCKINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+struct LListRecord;
+struct FreeBlockRecord;
+
+//A dense copy of the sizes and offsets of the blocks in a chunk's ordered free list, in the same address order.
+//Searches scan the sizes a vector at a time instead of chasing next links from block to block, which touches
+//one cache miss per block. Splice, unlink, split and coalesce keep it in step with the list. A chunk with more
+//free blocks than entries gives up on the index until the list has shrunk to half of that again
+
+#define FREE_INDEX_CAPACITY 512    //4KB, under 2% of a default chunk
+
+struct Free_Block_Index
+{
+    uint32_t count;
+    bool overflowed;    //the list outgrew the index at some point, so it is stale until rebuilt
+    uint32_t granules[FREE_INDEX_CAPACITY] __attribute__((aligned(32)));    //data size of each block, in granules
+    uint32_t offsets[FREE_INDEX_CAPACITY];    //each block's granule offset from the LListRecord
+};
+
+void Index_Clear(struct Free_Block_Index *index);
+//Called with the record already linked into, about to be unlinked from, or resized within the ordered list
+void Index_Insert(struct LListRecord *llist, struct FreeBlockRecord *record);
+void Index_Remove(struct LListRecord *llist, struct FreeBlockRecord *record);
+void Index_Resize(struct LListRecord *llist, struct FreeBlockRecord *record);
+//Rebuilds an overflowed index if the list is short enough again. Returns false if searches have to walk the list
+bool Index_Usable(struct LListRecord *llist);
+//First position at or after start whose block holds size bytes, or -1
+int Index_Find_From(const struct Free_Block_Index *index, size_t size, int start);
+
+#endif
@@ -3,13 +3,20 @@
 #include <string.h>
 #include "FreeBlockLList.h"
 #include "FreeBlockRecord.h"
+#include "Trace.h"
 #include "util.h"
 #include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
-#define TEST_SIZE 500
+static enum Placement_Policy placement_policy = FIRST_FIT;
+static bool deferred_purging = false;
+
+#ifdef FREEBLOCKLLIST_TEST
+#define TEST_SIZE (sizeof(struct LListRecord) + 500)
 int main()
 {
-    char mem[TEST_SIZE] = {0};
+    char mem[TEST_SIZE] __attribute__((aligned(64))) = {0};
 
     Init_LList((void *) mem, TEST_SIZE);
     hexDump(mem, TEST_SIZE);
@@ -45,15 +52,27 @@ int main()
 
     return 0;
 }
+#endif
 
 void Init_LList(struct LListRecord *llist, size_t size_of_entire_mmap_chunk)
 {
     die_if_false(llist, NULL);
     die_if_false(size_of_entire_mmap_chunk >= sizeof(struct LListRecord) + sizeof(struct FreeBlockRecord), "Space too small for LListRecord\n");
+    die_if_false(size_of_entire_mmap_chunk <= MAX_LLIST_SPACE, "Space too large for 32 bit block offsets\n");
 
     llist->length = 0;
     llist->head = llist->tail = NULL;
     llist->size_of_mmap_chunk = size_of_entire_mmap_chunk;
+    llist->unsorted_head = NULL;
+    llist->unsorted_length = 0;
+    llist->num_allocated = 0;
+    llist->rover = NULL;
+    llist->search_steps = 0;
+    llist->mmap_offset = 0;
+    llist->lifetime = LIFETIME_DEFAULT;
+    llist->reserved = false;
+    llist->idle = false;
+    Index_Clear(&llist->index);
 
     Init_FBR((void *) llist + sizeof(struct LListRecord),
             llist,
@@ -65,41 +84,334 @@ void Init_LList(struct LListRecord *llist, size_t size_of_entire_mmap_chunk)
 void *Alloc_Mem_Chunk_Of_Size(struct LListRecord *record, size_t size)
 {
     die_if_false(record, "Alloc_Mem_Chunk_Of_Size: record is NULL\n");
-    struct FreeBlockRecord *chunk = Find_Block_With_Enough_Space(record, size);
+    struct FreeBlockRecord *chunk = Take_From_Unsorted(record, size, GRANULE_SIZE);   //a recently freed block that fits needs no split at all
+    if(chunk)
+    {
+        chunk->flags &= ~FBR_FREE;
+        record->num_allocated++;
+        return (void*)chunk + FBR_HEADER_SIZE;
+    }
+
+    Flush_Unsorted_Blocks(record);                  //missed, so coalesce everything pending before searching
+    chunk = Find_Block_With_Enough_Space(record, size);
 
     if(!chunk) return NULL;
     Split_Record(chunk, record, size);              //split the block so it contains only the min space
     Unlink_From_LList(chunk, record);               //remove this free slace record from the list
-    return (void*)chunk + sizeof(size_t);           //the size field in the FreeBlockRecord gets preserved, prev/next get overwritten
+    chunk->flags &= ~FBR_FREE;
+    record->num_allocated++;
+    return (void*)chunk + FBR_HEADER_SIZE;          //the size field in the FreeBlockRecord gets preserved, prev/next get overwritten
 }                                                   //officially, the c compilere cannot change the order of vars in a struct, but may add padding
 
+//Where the data of an aligned allocation carved from record would start, or NULL if it does not fit
+//Anything left in front of it has to be big enough to stay behind as a free block of its own
+static void *Aligned_Start_In_Block(struct FreeBlockRecord *record, size_t size, size_t alignment)
+{
+    uintptr_t start = ((uintptr_t) record + FBR_HEADER_SIZE + alignment - 1) & ~(uintptr_t) (alignment - 1);
+    while(start - FBR_HEADER_SIZE != (uintptr_t) record && start - FBR_HEADER_SIZE - (uintptr_t) record < sizeof(struct FreeBlockRecord))
+        start += alignment;
+    if(start + size > (uintptr_t) Block_End(record)) return NULL;
+    return (void*) start;
+}
+
+//Whether record has room for size bytes at an address that is a multiple of alignment
+static inline bool Block_Fits(struct FreeBlockRecord *record, size_t size, size_t alignment)
+{
+    if(Get_Data_Size(record) < size) return false;
+    return alignment <= GRANULE_SIZE || Aligned_Start_In_Block(record, size, alignment);
+}
+
+static struct FreeBlockRecord *Find_Fitting_Block(struct LListRecord *record, size_t size, size_t alignment);
+
+//Find a block in the ordered list with room for size bytes at an aligned address and split off the misaligned
+//front, which stays in the list. The placement policy picks among the blocks that fit, as for any other request
+//Returns the block whose data starts at that address, still in the list, or NULL
+static struct FreeBlockRecord *Take_Aligned_Block(struct LListRecord *record, size_t size, size_t alignment)
+{
+    Flush_Unsorted_Blocks(record);
+    struct FreeBlockRecord *chunk = Find_Fitting_Block(record, size, alignment);
+    if(!chunk) return NULL;
+    void *mem = Aligned_Start_In_Block(chunk, size, alignment);
+
+    if(mem - FBR_HEADER_SIZE != (void*) chunk)
+    {
+        Split_Record(chunk, record, (mem - FBR_HEADER_SIZE) - (void*) chunk - FBR_HEADER_SIZE);
+        chunk = Get_Next(chunk, record);
+        die_if_false((void*) chunk + FBR_HEADER_SIZE == mem, "Take_Aligned_Block: split went wrong\n");
+    }
+    return chunk;
+}
+
+void *Alloc_Aligned_Mem_Chunk(struct LListRecord *record, size_t size, size_t alignment)
+{
+    die_if_false(record, "Alloc_Aligned_Mem_Chunk: record is NULL\n");
+    die_if_false(alignment && !(alignment & (alignment - 1)), "Alloc_Aligned_Mem_Chunk: alignment is not a power of two\n");
+    if(alignment <= GRANULE_SIZE) return Alloc_Mem_Chunk_Of_Size(record, size);
+    if(size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+
+    //Blocks freed from earlier aligned requests of the same size come back out of the unsorted list already lined up
+    struct FreeBlockRecord *chunk = Take_From_Unsorted(record, size, alignment);
+    if(chunk)
+    {
+        chunk->flags &= ~FBR_FREE;
+        record->num_allocated++;
+        return (void*)chunk + FBR_HEADER_SIZE;
+    }
+
+    chunk = Take_Aligned_Block(record, size, alignment);
+    if(!chunk) return NULL;
+    void *mem = (void*)chunk + FBR_HEADER_SIZE;
+    Split_Record(chunk, record, size);
+    Unlink_From_LList(chunk, record);
+    chunk->flags &= ~FBR_FREE;
+    record->num_allocated++;
+    return mem;
+}
+
+bool Alloc_Run(struct LListRecord *record, size_t data_size, size_t count, void **blocks_out)
+{
+    die_if_false(record, "Alloc_Run: record is NULL\n");
+    die_if_false(count && data_size >= MIN_BLOCK_SIZE && data_size % GRANULE_SIZE == 0, "Alloc_Run: bad run\n");
+
+    //The whole run as one line sized block, carved up below
+    size_t stride = FBR_HEADER_SIZE + data_size;
+    size_t run_size = Line_Data_Size(stride * count - FBR_HEADER_SIZE);
+    struct FreeBlockRecord *chunk = Take_Aligned_Block(record, run_size, CACHE_LINE_SIZE);
+    if(!chunk) return false;
+
+    for(size_t n = 0; n < count; n++)
+    {
+        size_t size = n + 1 < count ? data_size : run_size - n * stride;    //the last block takes the rest of the last line
+        Split_Record(chunk, record, size);
+        struct FreeBlockRecord *next = Get_Next(chunk, record);
+        Unlink_From_LList(chunk, record);
+        chunk->flags &= ~FBR_FREE;
+        record->num_allocated++;
+        blocks_out[n] = (void*)chunk + FBR_HEADER_SIZE;
+        chunk = next;
+    }
+    return true;
+}
+
 void Free_Mem_Chunk(struct LListRecord *llist, void *mem_addr)
 {
     die_if_false(llist,  "Free_Mem_Chunk: llist is NULL\n");
     die_if_false(mem_addr, "Free_Mem_Chunk: cannot free null pointer\n");
 
-    struct FreeBlockRecord *fbr = (mem_addr - sizeof(size_t));
-    fbr->next = fbr->prev = NULL;
-    Return_Block_To_List(llist, fbr);
+    //Defer the ordered insert and coalesce: park the block on the unsorted list, where the next
+    //allocation of the same size can pick it straight back up
+    struct FreeBlockRecord *fbr = (mem_addr - FBR_HEADER_SIZE);
+    fbr->flags = (fbr->flags & ~(FBR_PURGED | FBR_RESERVED)) | FBR_FREE;
+    fbr->prev = 0;
+    Set_Next(fbr, llist, llist->unsorted_head);
+    llist->unsorted_head = fbr;
+    llist->unsorted_length++;
+    llist->num_allocated--;
+
+    if(llist->unsorted_length > UNSORTED_FLUSH_THRESHOLD)
+        Flush_Unsorted_Blocks(llist);
 }
 
-struct FreeBlockRecord *Find_Block_With_Enough_Space(struct LListRecord *record, size_t size)
+//Exact or near fit from the unsorted list: a block the ordered search would not have split anyway
+//Only blocks whose data is a multiple of alignment qualify. Returns the block already unlinked, or NULL
+struct FreeBlockRecord *Take_From_Unsorted(struct LListRecord *llist, size_t size, size_t alignment)
 {
-    die_if_false(record, "Find_Block_With_Enough_Space: record is NULL\n");
+    die_if_false(llist, "Take_From_Unsorted: llist is NULL\n");
 
-    if(record->length == 0) {/*write_string(STDERR_FILENO, "Find_Block_With_enough_Space: no blocks\n", 50); */return NULL;}
-    struct FreeBlockRecord *fb_record = record->head;
+    if(size < MIN_BLOCK_SIZE) size = MIN_BLOCK_SIZE;
+    struct FreeBlockRecord *before = NULL;
+    for(struct FreeBlockRecord *current = llist->unsorted_head; current; before = current, current = Get_Next(current, llist))
+    {
+        if(Get_Data_Size(current) < size || Get_Data_Size(current) - size >= sizeof(struct FreeBlockRecord)) continue;
+        if(((uintptr_t) current + FBR_HEADER_SIZE) & (alignment - 1)) continue;
+
+        if(before) before->next = current->next;
+        else llist->unsorted_head = Get_Next(current, llist);
+        llist->unsorted_length--;
+        return current;
+    }
+
+    return NULL;
+}
+
+//Merge every pending free block into the ordered list, coalescing as we go
+void Flush_Unsorted_Blocks(struct LListRecord *llist)
+{
+    die_if_false(llist, "Flush_Unsorted_Blocks: llist is NULL\n");
+
+    struct FreeBlockRecord *current = llist->unsorted_head;
+    llist->unsorted_head = NULL;
+    llist->unsorted_length = 0;
+    while(current)
+    {
+        struct FreeBlockRecord *next = Get_Next(current, llist);
+        current->next = 0;
+        Return_Block_To_List(llist, current);
+        current = next;
+    }
+}
+
+static inline int Size_Class_Of(size_t size)
+{
+    return 63 - __builtin_clzl(size | 1);
+}
+
+//The finders below all take an alignment, and only consider blocks where an aligned start still leaves room.
+//The index only screens on size, so each of its hits is checked for alignment too
+
+static struct FreeBlockRecord *Find_First_Fit(struct LListRecord *record, size_t size, size_t alignment)
+{
+    if(Index_Usable(record))
+    {
+        int last = -1;
+        for(int n = Index_Find_From(&record->index, size, 0); n >= 0; n = Index_Find_From(&record->index, size, n + 1))
+        {
+            struct FreeBlockRecord *fb_record = Offset_To_FBR(record, record->index.offsets[n]);
+            last = n;
+            if(Block_Fits(fb_record, size, alignment))
+            {
+                record->search_steps += n + 1;
+                return fb_record;
+            }
+        }
+        record->search_steps += last < 0 ? record->index.count : (size_t) last + 1;
+        return NULL;
+    }
+
+    for(struct FreeBlockRecord *fb_record = record->head; fb_record; fb_record = Get_Next(fb_record, record))
+    {
+        record->search_steps++;
+        if(Block_Fits(fb_record, size, alignment))
+            return fb_record;
+    }
+
+    return NULL;
+}
+
+//Resume at the rover, wrap around to the head and stop once we are back where we started
+static struct FreeBlockRecord *Find_Next_Fit(struct LListRecord *record, size_t size, size_t alignment)
+{
+    struct FreeBlockRecord *start = record->rover ? record->rover : record->head;
+    struct FreeBlockRecord *fb_record = start;
     do
     {
-        if(fb_record->data_size >= size)
+        record->search_steps++;
+        if(Block_Fits(fb_record, size, alignment))
+        {
+            record->rover = fb_record;
             return fb_record;
-        else
-            fb_record = fb_record->next;
-    } while(fb_record);
+        }
+        fb_record = Get_Next(fb_record, record);
+        if(!fb_record) fb_record = record->head;
+    } while(fb_record != start);
 
     return NULL;
 }
 
+static struct FreeBlockRecord *Find_Best_Fit(struct LListRecord *record, size_t size, size_t alignment)
+{
+    struct FreeBlockRecord *best = NULL;
+    if(Index_Usable(record))
+    {
+        int best_n = -1;
+        for(int n = Index_Find_From(&record->index, size, 0); n >= 0; n = Index_Find_From(&record->index, size, n + 1))
+        {
+            record->search_steps++;
+            if(best_n >= 0 && record->index.granules[n] >= record->index.granules[best_n]) continue;
+            if(Block_Fits(Offset_To_FBR(record, record->index.offsets[n]), size, alignment))
+            {
+                best_n = n;
+                if((size_t) record->index.granules[n] * GRANULE_SIZE == size) break;    //cannot do better than exact
+            }
+        }
+        return best_n < 0 ? NULL : Offset_To_FBR(record, record->index.offsets[best_n]);
+    }
+
+    for(struct FreeBlockRecord *fb_record = record->head; fb_record; fb_record = Get_Next(fb_record, record))
+    {
+        record->search_steps++;
+        size_t data_size = Get_Data_Size(fb_record);
+        if(!Block_Fits(fb_record, size, alignment)) continue;
+        if(!best || data_size < Get_Data_Size(best))
+        {
+            best = fb_record;
+            if(data_size == size) break;    //cannot do better than exact
+        }
+    }
+
+    return best;
+}
+
+//First block in the same power of two class as the request. If the class has nothing, settle for first fit
+static struct FreeBlockRecord *Find_Good_Fit(struct LListRecord *record, size_t size, size_t alignment)
+{
+    struct FreeBlockRecord *first = NULL;
+    int wanted_class = Size_Class_Of(size);
+    for(struct FreeBlockRecord *fb_record = record->head; fb_record; fb_record = Get_Next(fb_record, record))
+    {
+        record->search_steps++;
+        size_t data_size = Get_Data_Size(fb_record);
+        if(!Block_Fits(fb_record, size, alignment)) continue;
+        if(Size_Class_Of(data_size) == wanted_class) return fb_record;
+        if(!first) first = fb_record;
+    }
+
+    return first;
+}
+
+static struct FreeBlockRecord *Find_Fitting_Block(struct LListRecord *record, size_t size, size_t alignment)
+{
+    if(record->length == 0) {/*write_string(STDERR_FILENO, "Find_Block_With_enough_Space: no blocks\n", 50); */return NULL;}
+    switch(placement_policy)
+    {
+        case NEXT_FIT: return Find_Next_Fit(record, size, alignment);
+        case BEST_FIT: return Find_Best_Fit(record, size, alignment);
+        case GOOD_FIT: return Find_Good_Fit(record, size, alignment);
+        default: return Find_First_Fit(record, size, alignment);
+    }
+}
+
+struct FreeBlockRecord *Find_Block_With_Enough_Space(struct LListRecord *record, size_t size)
+{
+    die_if_false(record, "Find_Block_With_Enough_Space: record is NULL\n");
+    return Find_Fitting_Block(record, size, GRANULE_SIZE);
+}
+
+void Set_Placement_Policy(enum Placement_Policy policy)
+{
+    placement_policy = policy;
+}
+
+enum Placement_Policy Get_Placement_Policy()
+{
+    return placement_policy;
+}
+
+void Set_Deferred_Purging(bool deferred)
+{
+    deferred_purging = deferred;
+}
+
+static const char *placement_policy_names[] = {"first_fit", "next_fit", "best_fit", "good_fit"};
+
+bool Parse_Placement_Policy(const char *name, enum Placement_Policy *policy_out)
+{
+    for(int n = FIRST_FIT; n <= GOOD_FIT; n++)
+    {
+        if(comp_strings(name, placement_policy_names[n], 20) == 0)
+        {
+            *policy_out = n;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *Placement_Policy_Name(enum Placement_Policy policy)
+{
+    return placement_policy_names[policy];
+}
+
 void Return_Block_To_List(struct LListRecord *llist, struct FreeBlockRecord *record)
 {
     die_if_false(llist, "Return_Block_To_List: llist is NULL\n");
@@ -108,17 +420,134 @@ void Return_Block_To_List(struct LListRecord *llist, struct FreeBlockRecord *rec
     struct FreeBlockRecord *before = NULL;
     struct FreeBlockRecord *after = NULL;
 
-    for(struct FreeBlockRecord *current = llist->head; current; current = current->next)
+    for(struct FreeBlockRecord *current = llist->head; current; current = Get_Next(current, llist))
     {
         if(current < record)
             before = current;
         if(current > record)    //llist is in memory order
         {
-            before = current->prev;
+            before = Get_Prev(current, llist);
             after = current;
             break;
         }
     }
     Splice_Between(record, llist, before, after);
-    Coalesce_If_Possible(record, llist);
-}
\ No newline at end of file
+
+    //Before the neighbours get absorbed, work out which part of the merged block can hold resident pages:
+    //this block, plus a neighbour unless its interior is already purged, in which case only its record is
+    void *dirty_start = record;
+    void *dirty_end = Block_End(record);
+    if(before && Block_End(before) == (void*) record && !(before->flags & FBR_PURGED))
+        dirty_start = before;
+    if(after && Block_End(record) == (void*) after)
+        dirty_end = (after->flags & FBR_PURGED) ? (void*) after + sizeof(struct FreeBlockRecord) : Block_End(after);
+
+    struct FreeBlockRecord *merged = Coalesce_If_Possible(record, llist);
+    if(Get_Data_Size(merged) < PURGE_THRESHOLD || llist->reserved || deferred_purging)    //a reserve keeps its pages faulted in
+    {
+        merged->flags &= ~FBR_PURGED;
+        return;
+    }
+    Purge_Free_Range(merged, dirty_start, dirty_end);
+    merged->flags |= FBR_PURGED;
+}
+
+static inline void *Page_Down(void *addr)
+{
+    return (void*) ((uintptr_t) addr & ~(uintptr_t) (PURGE_PAGE_SIZE - 1));
+}
+
+static inline void *Page_Up(void *addr)
+{
+    return Page_Down(addr + PURGE_PAGE_SIZE - 1);
+}
+
+size_t Purge_Free_Range(struct FreeBlockRecord *record, void *start, void *end)
+{
+    void *interior_start = Page_Up((void*) record + sizeof(struct FreeBlockRecord));
+    void *interior_end = Page_Down(Block_End(record));
+
+    start = Page_Down(start);    //a partly dirty page is still dirty
+    end = Page_Up(end);
+    if(start < interior_start) start = interior_start;
+    if(end > interior_end) end = interior_end;
+    if(start >= end) return 0;
+
+    if(madvise(start, end - start, MADV_DONTNEED) != 0) return 0;    //best effort, the pages just stay resident
+    MALLOC_TRACE_EVENT(TRACE_PURGE, start, end - start);
+    return end - start;
+}
+
+bool Find_Zeroed_Pages(void *mem_addr, void **start_out, void **end_out)
+{
+    struct FreeBlockRecord *fbr = mem_addr - FBR_HEADER_SIZE;
+    void *clean_start = Page_Up((void*) fbr + sizeof(struct FreeBlockRecord));
+    void *clean_end = Page_Down(Block_End(fbr));
+
+    if(!(fbr->flags & FBR_PURGED) || clean_start >= clean_end) return false;
+    *start_out = clean_start;
+    *end_out = clean_end;
+    return true;
+}
+
+struct FreeBlockRecord *First_Block(struct LListRecord *llist)
+{
+    return (void*) llist + sizeof(struct LListRecord);
+}
+
+//Blocks tile the chunk, so the next one starts where this one's data ends. NULL past the last block
+struct FreeBlockRecord *Next_Block(struct LListRecord *llist, struct FreeBlockRecord *record)
+{
+    struct FreeBlockRecord *next = Block_End(record);
+    if((void*) next + sizeof(struct FreeBlockRecord) > (void*) llist + llist->size_of_mmap_chunk) return NULL;
+    return next;
+}
+
+static void Add_To_Stats(struct LList_Stats *stats, struct FreeBlockRecord *record)
+{
+    size_t data_size = Get_Data_Size(record);
+    stats->free_blocks++;
+    stats->free_bytes += data_size;
+    if(data_size > stats->largest_free) stats->largest_free = data_size;
+    if(record->flags & FBR_PURGED) stats->purged_blocks++;
+}
+
+void Get_LList_Stats(struct LListRecord *llist, struct LList_Stats *stats)
+{
+    stats->free_blocks = stats->free_bytes = stats->largest_free = stats->purged_blocks = 0;
+    for(struct FreeBlockRecord *record = llist->head; record; record = Get_Next(record, llist))
+        Add_To_Stats(stats, record);
+    for(struct FreeBlockRecord *record = llist->unsorted_head; record; record = Get_Next(record, llist))
+        Add_To_Stats(stats, record);
+}
+
+size_t Purge_All_Free_Blocks(struct LListRecord *llist, size_t *pad)
+{
+    size_t released = 0;
+    for(struct FreeBlockRecord *record = llist->head; record; record = Get_Next(record, llist))
+    {
+        if(record->flags & FBR_PURGED) continue;
+        if(*pad >= Get_Data_Size(record))
+        {
+            *pad -= Get_Data_Size(record);
+            continue;
+        }
+
+        released += Purge_Free_Range(record, (void*) record + FBR_HEADER_SIZE + *pad, Block_End(record));
+        if(!*pad) record->flags |= FBR_PURGED;    //a block that keeps part of the pad resident cannot be flagged
+        *pad = 0;
+    }
+    return released;
+}
+
+size_t Purge_Large_Free_Blocks(struct LListRecord *llist)
+{
+    size_t released = 0;
+    for(struct FreeBlockRecord *record = llist->head; record; record = Get_Next(record, llist))
+    {
+        if((record->flags & FBR_PURGED) || Get_Data_Size(record) < PURGE_THRESHOLD) continue;
+        released += Purge_Free_Range(record, record, Block_End(record));
+        record->flags |= FBR_PURGED;
+    }
+    return released;
+}
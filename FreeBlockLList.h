@@ -2,24 +2,108 @@
 #define FREEBLOCKLLIST_H
 
 #include <stddef.h>
+#include <stdbool.h>
+#include "FreeBlockIndex.h"
 
 struct FreeBlockRecord;
 
+//How Find_Block_With_Enough_Space picks among the blocks that fit
+enum Placement_Policy
+{
+    FIRST_FIT,    //lowest address that fits
+    NEXT_FIT,     //first fit, but resuming where the last search left off (the rover)
+    BEST_FIT,     //smallest block that fits
+    GOOD_FIT      //first block in the request's power of two size class, else first fit
+};
+
+//Which allocations a chunk takes. Hinted ones only share chunks with others of the same expected lifetime,
+//so short lived garbage frees whole chunks and long lived objects do not leave holes everywhere
+enum Lifetime_Class
+{
+    LIFETIME_DEFAULT,
+    LIFETIME_SHORT,
+    LIFETIME_LONG
+};
+
 struct LListRecord
 {
     struct FreeBlockRecord *head;
     struct FreeBlockRecord *tail;
     size_t length;    //num records
     size_t size_of_mmap_chunk;
+    struct FreeBlockRecord *unsorted_head;    //recently freed blocks, not yet merged into the ordered list. Linked through next only
+    size_t unsorted_length;
+    size_t num_allocated;    //blocks currently handed out of this chunk
+    struct FreeBlockRecord *rover;    //where the next NEXT_FIT search starts. NULL means head
+    size_t search_steps;     //blocks examined by all searches so far, for profiling placement
+    size_t mmap_offset;      //bytes between the start of the mapping and this record, the chunk's cache colour
+    enum Lifetime_Class lifetime;
+    bool reserved;    //mapped by malloc_reserve: stays mapped when empty and its free blocks are never purged
+    bool idle;        //empty when background maintenance last came by, it is released if it still is next time
+    struct Free_Block_Index index;    //sizes of the ordered list's blocks, for FIRST_FIT, BEST_FIT and aligned searches
+};
+
+//What munmap needs to release a chunk that has been taken out of the heap
+struct Chunk_Mapping
+{
+    void *start;
+    size_t length;
+};
+
+#define MAINTENANCE_STEP_CHUNKS 16      //chunks background maintenance deals with per hold of the heap lock
+#define MAINTENANCE_STEP_SLOTS 4096     //llists slots it looks through per hold, empty ones included
+
+struct LList_Stats
+{
+    size_t free_blocks;     //in the ordered and the unsorted list together
+    size_t free_bytes;
+    size_t largest_free;
+    size_t purged_blocks;
 };
 
 #define MIN_LLIST_SPACE sizeof(struct LListRecord)
+#define UNSORTED_FLUSH_THRESHOLD 32    //once this many frees are pending, coalesce them all in one go
+#define PURGE_PAGE_SIZE 4096
+#define PURGE_THRESHOLD 65536          //coalesced free blocks at least this large give their interior pages back
 
 void Init_LList(struct LListRecord *record, size_t size_of_entire_mmap_chunk);
 void *Alloc_Mem_Chunk_Of_Size(struct LListRecord *record, size_t size);
+//As above, but the returned address is a multiple of alignment, which must be a power of two
+void *Alloc_Aligned_Mem_Chunk(struct LListRecord *record, size_t size, size_t alignment);
+//Carve count blocks of data_size, one after the other, out of a single run that starts its data on a cache line
+//and is line sized as a whole, so none of its lines is shared with a block outside it. The last block takes
+//whatever the run has left over. Returns false, having taken nothing, if no free block holds the whole run
+bool Alloc_Run(struct LListRecord *record, size_t data_size, size_t count, void **blocks_out);
 void Free_Mem_Chunk(struct LListRecord *record, void *mem_addr);
 
 struct FreeBlockRecord *Find_Block_With_Enough_Space(struct LListRecord *record, size_t size);
 void Return_Block_To_List(struct LListRecord *llist, struct FreeBlockRecord *record);
+struct FreeBlockRecord *Take_From_Unsorted(struct LListRecord *llist, size_t size, size_t alignment);
+void Flush_Unsorted_Blocks(struct LListRecord *llist);
+//madvise away the whole pages of a free block between start and end, clipped to the pages past its record
+//Returns the number of bytes released
+size_t Purge_Free_Range(struct FreeBlockRecord *record, void *start, void *end);
+//Walk every block of the chunk in address order, free or not
+struct FreeBlockRecord *First_Block(struct LListRecord *llist);
+struct FreeBlockRecord *Next_Block(struct LListRecord *llist, struct FreeBlockRecord *record);
+void Get_LList_Stats(struct LListRecord *llist, struct LList_Stats *stats);
+//Purge every block of the ordered list no matter how small, leaving the first *pad free bytes resident
+//*pad is reduced by what was kept, so it can be carried on to the next chunk. Returns the bytes released
+size_t Purge_All_Free_Blocks(struct LListRecord *llist, size_t *pad);
+//Purge the ordered list's blocks of at least PURGE_THRESHOLD that are not purged yet, which is what coalescing
+//would have done had purging not been deferred. Returns the bytes released
+size_t Purge_Large_Free_Blocks(struct LListRecord *llist);
+//While background maintenance runs, coalescing leaves large blocks resident for Purge_Large_Free_Blocks,
+//so the madvise calls happen on its thread instead of the one that freed
+void Set_Deferred_Purging(bool deferred);
+//For an allocated block, the whole pages FBR_PURGED says still read as zero. Returns false if there are none
+bool Find_Zeroed_Pages(void *mem_addr, void **start_out, void **end_out);
+
+//The policy is global rather than per chunk. Every policy searches the same ordered list, so it may change at any time
+void Set_Placement_Policy(enum Placement_Policy policy);
+enum Placement_Policy Get_Placement_Policy();
+//Accepts first_fit, next_fit, best_fit and good_fit. Returns false and leaves policy_out alone otherwise
+bool Parse_Placement_Policy(const char *name, enum Placement_Policy *policy_out);
+const char *Placement_Policy_Name(enum Placement_Policy policy);
 
 #endif
\ No newline at end of file
@@ -1,12 +1,15 @@
 #include <assert.h>
 #include "FreeBlockRecord.h"
 #include "FreeBlockLList.h"
+#include "FreeBlockIndex.h"
+#include "Trace.h"
 #include "util.h"
 
 void Init_FBR(struct FreeBlockRecord *record, struct LListRecord *llist, struct FreeBlockRecord *prev, struct FreeBlockRecord *next, size_t size_of_entire_block)
 {
     die_if_false(size_of_entire_block >= sizeof(struct FreeBlockRecord), "Cannot init FBR with size that small\n");
-    record->data_size = size_of_entire_block - sizeof(size_t);
+    Set_Data_Size(record, size_of_entire_block - FBR_HEADER_SIZE);    //rounds down, any slop past the last granule is never used
+    record->flags = FBR_FREE;
     Splice_Between(record, llist, prev, next);
 }
 
@@ -16,18 +19,24 @@ void Init_FBR(struct FreeBlockRecord *record, struct LListRecord *llist, struct
 bool Split_Record(struct FreeBlockRecord *record, struct LListRecord *llist, size_t wanted_data_size)
 {
     //if(wanted_data_size <= record->data_size && wanted_data_size < MIN_BLOCK_SIZE) {write_string(STDERR_FILENO, "test\n", 5); return false;}
-    die_if_false(record->data_size >= MIN_BLOCK_SIZE, "Split_record: data_size error\n");
+    die_if_false(Get_Data_Size(record) >= MIN_BLOCK_SIZE, "Split_record: data_size error\n");
     if(wanted_data_size < MIN_BLOCK_SIZE) wanted_data_size = MIN_BLOCK_SIZE;
+    if(wanted_data_size % GRANULE_SIZE != 0) wanted_data_size += GRANULE_SIZE - wanted_data_size % GRANULE_SIZE;
     die_if_false(record, "Split_Record: FBR is NULL\n");
-    die_if_false(record->data_size >= wanted_data_size, "Split_Record: Cannot grow FBR by splitting it in two\n");
+    size_t data_size = Get_Data_Size(record);
+    die_if_false(data_size >= wanted_data_size, "Split_Record: Cannot grow FBR by splitting it in two\n");
 
-    if(record->data_size == wanted_data_size) {/*write_string(STDERR_FILENO, "Split_Record: wanted size is current size\n", 50); */return false;} //Nothing to do
-    if(record->data_size < sizeof(struct FreeBlockRecord) - sizeof(size_t)) {/*write_string(STDERR_FILENO, "Split_Record: record is too small to split in any way\n", 70); */return false;}
-    if(record->data_size - wanted_data_size < sizeof(struct FreeBlockRecord)) {/*write_string(STDERR_FILENO, "Split_Record: cannot fit new FBR in leftover memory\n", 70); */return false;}
+    if(data_size == wanted_data_size) {/*write_string(STDERR_FILENO, "Split_Record: wanted size is current size\n", 50); */return false;} //Nothing to do
+    if(data_size < sizeof(struct FreeBlockRecord) - FBR_HEADER_SIZE) {/*write_string(STDERR_FILENO, "Split_Record: record is too small to split in any way\n", 70); */return false;}
+    if(data_size - wanted_data_size < sizeof(struct FreeBlockRecord)) {/*write_string(STDERR_FILENO, "Split_Record: cannot fit new FBR in leftover memory\n", 70); */return false;}
 
     //Actually split the record
-    Init_FBR(((void*) record) + wanted_data_size + sizeof(size_t), llist, record, record->next, record->data_size - wanted_data_size);
-    record->data_size = wanted_data_size;
+    struct FreeBlockRecord *rest = ((void*) record) + wanted_data_size + FBR_HEADER_SIZE;
+    Init_FBR(rest, llist, record, Get_Next(record, llist), data_size - wanted_data_size);
+    rest->flags |= record->flags & FBR_PURGED;    //its pages past its own record are a subset of ours
+    Set_Data_Size(record, wanted_data_size);
+    Index_Resize(llist, record);
+    MALLOC_TRACE_EVENT(TRACE_SPLIT, record, wanted_data_size);
     return true;
 }
 
@@ -36,50 +45,59 @@ bool Split_Record(struct FreeBlockRecord *record, struct LListRecord *llist, siz
 struct FreeBlockRecord *Coalesce_If_Possible(struct FreeBlockRecord *record, struct LListRecord *llist)
 {
     struct FreeBlockRecord *result = record;
-    if(record->next)
+    bool merged = false;
+    struct FreeBlockRecord *next = Get_Next(record, llist);
+    struct FreeBlockRecord *prev = Get_Prev(record, llist);
+    if(next)
     {
-        die_if_false(record->next->prev == record, "Link Error\n");
-        die_if_false(record < record->next, "Ordering error, next is behind this record\n");
+        die_if_false(Get_Prev(next, llist) == record, "Link Error\n");
+        die_if_false(record < next, "Ordering error, next is behind this record\n");
 
-        if((void*) record->next - record->data_size - sizeof(size_t) == record)
+        if((void*) next - Get_Data_Size(record) - FBR_HEADER_SIZE == record)
         {
             //write_string(STDERR_FILENO, "coalase right\n", 50);
-            record->data_size += record->next->data_size + sizeof(size_t);
-            Unlink_From_LList(record->next, llist);
+            Set_Data_Size(record, Get_Data_Size(record) + Get_Data_Size(next) + FBR_HEADER_SIZE);
+            Index_Resize(llist, record);
+            Unlink_From_LList(next, llist);
+            merged = true;
         }
     }
-    if(record->prev)
+    if(prev)
     {
-        die_if_false(record->prev->next == record, "Link Error\n");
-        die_if_false(record > record->prev, "Ordering error, prev is ahead of this record\n");
+        die_if_false(Get_Next(prev, llist) == record, "Link Error\n");
+        die_if_false(record > prev, "Ordering error, prev is ahead of this record\n");
 
-        if((void*) record->prev + record->prev->data_size + sizeof(size_t) == record)
+        if((void*) prev + Get_Data_Size(prev) + FBR_HEADER_SIZE == record)
         {
             //write_string(STDERR_FILENO, "coalase left\n", 50);
-            result = record->prev;
-            record->prev->data_size += record->data_size + sizeof(size_t);
+            result = prev;
+            Set_Data_Size(prev, Get_Data_Size(prev) + Get_Data_Size(record) + FBR_HEADER_SIZE);
+            Index_Resize(llist, prev);
             Unlink_From_LList(record, llist);
+            merged = true;
         }
     }
     die_if_false(!(llist->length>1) || result->prev || result->next, "link error\n");
+    if(merged) MALLOC_TRACE_EVENT(TRACE_COALESCE, result, Get_Data_Size(result));
     return result;
 }
 
 void Splice_Between(struct FreeBlockRecord *record, struct LListRecord *llist, struct FreeBlockRecord *left, struct FreeBlockRecord *right)
 {
-    record->prev = left;
-    record->next = right;
-    if(left && right) die_if_false(left->next == right && right->prev == left, "Splice_Between: Link error\n");
+    Set_Prev(record, llist, left);
+    Set_Next(record, llist, right);
+    if(left && right) die_if_false(Get_Next(left, llist) == right && Get_Prev(right, llist) == left, "Splice_Between: Link error\n");
     if(!left) die_if_false(right == llist->head, "Splice_Between: if left is NULL, then record is the new head of the list. But the current head must equal right, or the splice is invalid.\n");
     if(!right) die_if_false(left == llist->tail, "Splice_Between: if right is NULL, then record is the new tail of the list. But the current tail must equal left, or the splice is invalid.\n");
 
-    if(left) left->next = record;
+    if(left) Set_Next(left, llist, record);
     else llist->head = record;
 
-    if(right) right->prev = record;
+    if(right) Set_Prev(right, llist, record);
     else llist->tail = record;
 
     llist->length++;
+    Index_Insert(llist, record);
     die_if_false(!(llist->length>1) || (record->prev || record->next), "Splice_between: link error\n");
 }
 
@@ -88,26 +106,28 @@ void Unlink_From_LList(struct FreeBlockRecord *record, struct LListRecord *llist
     die_if_false(record, "Unlink_From_LList: record is NULL\n");
     die_if_false(llist, "Unlink_From_LList: llist is NULL\n");
 
-    struct FreeBlockRecord *prev = record->prev;
-    struct FreeBlockRecord *next = record->next;
+    struct FreeBlockRecord *prev = Get_Prev(record, llist);
+    struct FreeBlockRecord *next = Get_Next(record, llist);
 
+    Index_Remove(llist, record);
     if(llist->head == record) llist->head = next;
     if(llist->tail == record) llist->tail = prev;
+    if(llist->rover == record) llist->rover = next;
 
     if(next)
     {
-        die_if_false(next->prev == record, "Unlink_From_LList: Link error\n");
-        next->prev = prev;
-        record->next = NULL;
+        die_if_false(Get_Prev(next, llist) == record, "Unlink_From_LList: Link error\n");
+        Set_Prev(next, llist, prev);
+        record->next = 0;
     }
 
     if(prev)
     {
-        die_if_false(prev->next == record, "Unlink_From_LList: Link error\n");
-        prev->next = next;
-        record->prev = NULL;
+        die_if_false(Get_Next(prev, llist) == record, "Unlink_From_LList: Link error\n");
+        Set_Next(prev, llist, next);
+        record->prev = 0;
     }
     llist->length--;
     if(prev) die_if_false(!(llist->length>1) || (prev->prev || prev->next), "Unlink_From_LList: link error\n");
     if(next) die_if_false(!(llist->length>1) || (next->prev || next->next), "Unlink_From_LList: link error\n");
-}
+}
\ No newline at end of file
@@ -2,18 +2,86 @@
 #define FREEBLOCKRECORD_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 struct LListRecord;
 
+//Links are 32 bit granule offsets from the owning LListRecord rather than full pointers; offset 0 is the
+//LListRecord itself, so it doubles as NULL. Sizes are in granules too, which caps a chunk at MAX_LLIST_SPACE
 struct FreeBlockRecord
 {
-    size_t data_size;    //size of the memory that may be stored in this block. When this block is allocated out, prev and next get overritten, but size does not
-    struct FreeBlockRecord *prev;
-    struct FreeBlockRecord *next;
+    uint32_t data_granules;    //size of the memory that may be stored in this block. When this block is allocated out, prev and next get overritten, but size does not
+    uint32_t flags;            //FBR_ flags below. Like the size, they survive allocation
+    uint32_t prev;
+    uint32_t next;
 };
 
-#define MIN_BLOCK_SIZE (2*sizeof(void*))
+#define GRANULE_SIZE 8
+//Every whole page between the end of the record and the end of the data is known to be zero and not resident,
+//either fresh from mmap or given back with madvise. Cleared as soon as the block is freed dirty
+#define FBR_PURGED 0x1
+#define FBR_FREE 0x2    //in the ordered or the unsorted list, rather than handed out
+#define FBR_RESERVED 0x8    //carved for a size class reserve, free puts it back there rather than in its chunk
+#define FBR_HEADER_SIZE (2*sizeof(uint32_t))    //the part of the record that survives allocation
+#define MIN_BLOCK_SIZE (2*sizeof(uint32_t))
+#define MAX_LLIST_SPACE ((size_t) UINT32_MAX * GRANULE_SIZE)
+#define CACHE_LINE_SIZE 64
+
+//Data size for a block whose data starts on a cache line: it ends one record short of the next line, so the
+//block after it can start its data on a line too. Two blocks laid out like this never share a line of data.
+//That costs up to a line per block, 64 bytes of data take a 128 byte block, so only cache refill runs, as a
+//whole, and MALLOC_HINT_HOT blocks are laid out this way
+static inline size_t Line_Data_Size(size_t size)
+{
+    return ((size + FBR_HEADER_SIZE + CACHE_LINE_SIZE - 1) & ~(size_t) (CACHE_LINE_SIZE - 1)) - FBR_HEADER_SIZE;
+}
+
+static inline size_t Get_Data_Size(const struct FreeBlockRecord *record)
+{
+    return (size_t) record->data_granules * GRANULE_SIZE;
+}
+
+static inline void Set_Data_Size(struct FreeBlockRecord *record, size_t data_size)
+{
+    record->data_granules = (uint32_t) (data_size / GRANULE_SIZE);
+}
+
+//First byte past the block's data, which is where the next block's record starts
+static inline void *Block_End(const struct FreeBlockRecord *record)
+{
+    return (char *) record + FBR_HEADER_SIZE + Get_Data_Size(record);
+}
+
+static inline struct FreeBlockRecord *Offset_To_FBR(const struct LListRecord *llist, uint32_t offset)
+{
+    return offset ? (struct FreeBlockRecord *) ((char *) llist + (size_t) offset * GRANULE_SIZE) : NULL;
+}
+
+static inline uint32_t FBR_To_Offset(const struct LListRecord *llist, const struct FreeBlockRecord *record)
+{
+    return record ? (uint32_t) (((const char *) record - (const char *) llist) / GRANULE_SIZE) : 0;
+}
+
+static inline struct FreeBlockRecord *Get_Prev(const struct FreeBlockRecord *record, const struct LListRecord *llist)
+{
+    return Offset_To_FBR(llist, record->prev);
+}
+
+static inline struct FreeBlockRecord *Get_Next(const struct FreeBlockRecord *record, const struct LListRecord *llist)
+{
+    return Offset_To_FBR(llist, record->next);
+}
+
+static inline void Set_Prev(struct FreeBlockRecord *record, const struct LListRecord *llist, struct FreeBlockRecord *prev)
+{
+    record->prev = FBR_To_Offset(llist, prev);
+}
+
+static inline void Set_Next(struct FreeBlockRecord *record, const struct LListRecord *llist, struct FreeBlockRecord *next)
+{
+    record->next = FBR_To_Offset(llist, next);
+}
 
 void Init_FBR(struct FreeBlockRecord *record, struct LListRecord *llist, struct FreeBlockRecord *prev, struct FreeBlockRecord *next, size_t size_of_entire_block);
 bool Split_Record(struct FreeBlockRecord *record, struct LListRecord *llist, size_t wanted_size);
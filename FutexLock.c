@@ -0,0 +1,59 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "FutexLock.h"
+#include "Trace.h"
+
+static inline void Spin_Pause()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline bool Try_Take(struct Futex_Lock *lock)
+{
+    int expected = 0;
+    return __atomic_compare_exchange_n(&lock->state, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void Futex_Lock_Acquire(struct Futex_Lock *lock)
+{
+    MALLOC_TRACE_THREAD_START();    //while the lock is not ours yet, setting up may allocate
+    if(Try_Take(lock))
+    {
+        lock->acquisitions++;
+        return;
+    }
+
+    uint64_t start = Read_Cycle_Counter();
+    for(int spin = 0; spin < FUTEX_SPIN_LIMIT; spin++)
+    {
+        Spin_Pause();
+        if(__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 && Try_Take(lock)) goto acquired;
+    }
+
+    //Mark the lock as having sleepers before going to sleep on it, so the holder knows to wake us.
+    //Whoever gets it this way keeps the mark, it cannot tell whether anyone else is still asleep
+    while(__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0)
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+
+acquired:
+    lock->acquisitions++;
+    lock->contended_acquisitions++;
+    uint64_t waited = Read_Cycle_Counter() - start;
+    lock->wait_cycles += waited;
+    MALLOC_TRACE_EVENT(TRACE_LOCK_CONTENDED, lock, waited);
+}
+
+void Futex_Lock_Release(struct Futex_Lock *lock)
+{
+    if(__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
\ No newline at end of file
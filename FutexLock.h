@@ -0,0 +1,36 @@
+#ifndef FUTEXLOCK_H
+#define FUTEXLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+//The heap lock. Critical sections are usually well under a microsecond, so a waiter spins for a while
+//before it sleeps on a futex. The counters are only written while holding the lock
+
+struct Futex_Lock
+{
+    int state;                          //0 unlocked, 1 locked, 2 locked and someone may be asleep on it
+    uint64_t acquisitions;
+    uint64_t contended_acquisitions;    //acquisitions that did not get the lock on the first try
+    uint64_t wait_cycles;               //cycle counter ticks spent by those waiting, spinning or asleep
+};
+
+//Cycle counter ticks where there is one, nanoseconds otherwise. Also timestamps trace events
+static inline uint64_t Read_Cycle_Counter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+#define FUTEX_LOCK_INITIALIZER {0, 0, 0, 0}
+#define FUTEX_SPIN_LIMIT 128
+
+void Futex_Lock_Acquire(struct Futex_Lock *lock);
+void Futex_Lock_Release(struct Futex_Lock *lock);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,156 @@
+#include <stdint.h>
+#include "ObjectPool.h"
+#include "FreeBlockRecord.h"
+#include "util.h"
+
+void *__malloc_impl(size_t);
+void __free_impl(void *);
+
+struct Object_Pool pools[MAX_POOLS] = {{0}};
+__thread struct Pool_Magazine *pool_magazines[MAX_POOLS] = {0};
+
+static inline size_t Round_Up(size_t value, size_t multiple)
+{
+    return (value + multiple - 1) & ~(multiple - 1);    //multiple must be a power of two
+}
+
+static inline void Push_To_Depot(struct Object_Pool *pool, void *object)
+{
+    *(void **) object = pool->depot;
+    pool->depot = object;
+    pool->depot_length++;
+}
+
+static inline void *Pop_From_Depot(struct Object_Pool *pool)
+{
+    void *object = pool->depot;
+    pool->depot = *(void **) object;
+    pool->depot_length--;
+    return object;
+}
+
+struct Object_Pool *Pool_Create(size_t size, size_t alignment)
+{
+    if(size == 0 || size > POOL_SLAB_SIZE) return NULL;
+    if(alignment == 0 || (alignment & (alignment - 1)) || alignment > MAX_POOL_ALIGNMENT) return NULL;
+    if(alignment < sizeof(void *)) alignment = sizeof(void *);    //free objects hold the depot link
+    if(size < sizeof(void *)) size = sizeof(void *);
+
+    for(size_t n = 0; n < MAX_POOLS; n++)
+    {
+        if(pools[n].object_size) continue;
+        pools[n].object_size = Round_Up(size, alignment);
+        pools[n].alignment = alignment;
+        pools[n].depot = NULL;
+        pools[n].depot_length = 0;
+        pools[n].slabs = NULL;
+        pools[n].generation++;
+        pools[n].next_colour = 0;
+        return &pools[n];
+    }
+
+    return NULL;
+}
+
+void Pool_Destroy(struct Object_Pool *pool)
+{
+    die_if_false(pool->object_size, "Pool_Destroy: pool is not in use\n");
+
+    void *slab = pool->slabs;
+    while(slab)
+    {
+        void *next = *(void **) slab;
+        __free_impl(slab);
+        slab = next;
+    }
+    pool->object_size = 0;
+    pool->depot = NULL;
+    pool->depot_length = 0;
+    pool->slabs = NULL;
+    pool->generation++;    //every magazine still holding objects from the old slabs is now stale
+}
+
+//The calling thread's magazine for pool, allocated on first use and emptied if it is stale
+static struct Pool_Magazine *Get_Magazine(struct Object_Pool *pool)
+{
+    struct Pool_Magazine **slot = &pool_magazines[pool - pools];
+    if(!*slot)
+    {
+        *slot = __malloc_impl(sizeof(struct Pool_Magazine));
+        if(!*slot) return NULL;
+        (*slot)->count = 0;
+        (*slot)->generation = pool->generation;
+    }
+    if((*slot)->generation != pool->generation)
+    {
+        (*slot)->count = 0;    //those objects went away with the old pool's slabs
+        (*slot)->generation = pool->generation;
+    }
+    return *slot;
+}
+
+//Take a fresh slab from the chunks and put all of its objects in the depot
+//The slab keeps a link to the previous slab in its first word, so objects start at the first aligned address after it,
+//pushed a few cache lines further in so the first objects of different slabs do not all compete for the same L1 sets
+static bool Carve_Slab(struct Object_Pool *pool)
+{
+    size_t colour = pool->next_colour * CACHE_LINE_SIZE;
+    size_t slab_size = pool->object_size * MAGAZINE_SIZE + pool->alignment + sizeof(void *) + colour;
+    if(slab_size < POOL_SLAB_SIZE) slab_size = POOL_SLAB_SIZE;
+
+    void *slab = __malloc_impl(slab_size);
+    if(!slab) return false;
+    *(void **) slab = pool->slabs;
+    pool->slabs = slab;
+
+    uintptr_t end = (uintptr_t) slab + slab_size;
+    for(uintptr_t object = Round_Up((uintptr_t) slab + sizeof(void *) + colour, pool->alignment); object + pool->object_size <= end; object += pool->object_size)
+        Push_To_Depot(pool, (void *) object);
+    pool->next_colour = (pool->next_colour + 1) % POOL_SLAB_COLOURS;
+    return true;
+}
+
+void *Pool_Get_Refill(struct Object_Pool *pool)
+{
+    die_if_false(pool->object_size, "Pool_Get_Refill: pool is not in use\n");
+
+    struct Pool_Magazine *magazine = Get_Magazine(pool);
+    if(!pool->depot && !Carve_Slab(pool)) return NULL;
+    if(!magazine) return Pop_From_Depot(pool);    //no memory for a magazine, still serve the object uncached
+
+    //Only fill half way, so a put right after does not go straight back to the depot
+    while(pool->depot && magazine->count < MAGAZINE_SIZE / 2)
+        magazine->objects[magazine->count++] = Pop_From_Depot(pool);
+    return magazine->objects[--magazine->count];
+}
+
+void Pool_Put_Flush(struct Object_Pool *pool, void *object)
+{
+    die_if_false(pool->object_size, "Pool_Put_Flush: pool is not in use\n");
+
+    struct Pool_Magazine *magazine = Get_Magazine(pool);
+    if(!magazine)
+    {
+        Push_To_Depot(pool, object);
+        return;
+    }
+
+    while(magazine->count > MAGAZINE_SIZE / 2)
+        Push_To_Depot(pool, magazine->objects[--magazine->count]);
+    magazine->objects[magazine->count++] = object;
+}
+
+void Pool_Thread_Exit()
+{
+    for(size_t n = 0; n < MAX_POOLS; n++)
+    {
+        struct Pool_Magazine *magazine = pool_magazines[n];
+        if(!magazine) continue;
+
+        if(pools[n].object_size && magazine->generation == pools[n].generation)
+            while(magazine->count)
+                Push_To_Depot(&pools[n], magazine->objects[--magazine->count]);
+        __free_impl(magazine);
+        pool_magazines[n] = NULL;
+    }
+}
\ No newline at end of file
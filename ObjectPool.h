@@ -0,0 +1,64 @@
+#ifndef OBJECTPOOL_H
+#define OBJECTPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+//Fixed size object pools. Objects are carved out of slabs taken from the ordinary chunks and
+//handed out through per thread magazines, so get and put only touch thread local memory until a
+//magazine runs empty or full. The shared depot and the slabs are protected by the caller's heap lock
+
+#define MAX_POOLS 64
+#define MAGAZINE_SIZE 32
+#define POOL_SLAB_SIZE 65536
+#define MAX_POOL_ALIGNMENT 4096
+#define POOL_SLAB_COLOURS 16    //successive slabs start their objects 0 to 15 cache lines in
+
+struct Object_Pool
+{
+    size_t object_size;    //stride between objects, a multiple of alignment. 0 means this slot is unused
+    size_t alignment;
+    void *depot;           //free objects not in any magazine, linked through their first word
+    size_t depot_length;
+    void *slabs;           //slabs from __malloc_impl, linked through their first word
+    size_t generation;     //bumped on create and destroy, so magazines can tell they are stale
+    size_t next_colour;    //cache lines the next slab skips before its first object
+};
+
+struct Pool_Magazine
+{
+    size_t generation;     //generation of the pool the objects belong to
+    size_t count;
+    void *objects[MAGAZINE_SIZE];
+};
+
+extern struct Object_Pool pools[MAX_POOLS];
+extern __thread struct Pool_Magazine *pool_magazines[MAX_POOLS];
+
+//Lock free fast paths, only ever touching the calling thread's magazine
+static inline void *Pool_Get_Cached(struct Object_Pool *pool)
+{
+    struct Pool_Magazine *magazine = pool_magazines[pool - pools];
+    if(!magazine || !magazine->count || magazine->generation != pool->generation) return NULL;
+    return magazine->objects[--magazine->count];
+}
+
+static inline bool Pool_Put_Cached(struct Object_Pool *pool, void *object)
+{
+    struct Pool_Magazine *magazine = pool_magazines[pool - pools];
+    if(!magazine || magazine->count == MAGAZINE_SIZE || magazine->generation != pool->generation) return false;
+    magazine->objects[magazine->count++] = object;
+    return true;
+}
+
+//Everything below must be called with the heap lock held
+struct Object_Pool *Pool_Create(size_t size, size_t alignment);
+void Pool_Destroy(struct Object_Pool *pool);
+//Refills the calling thread's magazine from the depot or a new slab, returns NULL if out of memory
+void *Pool_Get_Refill(struct Object_Pool *pool);
+//Makes room in the calling thread's magazine by moving half of it to the depot, then caches object
+void Pool_Put_Flush(struct Object_Pool *pool, void *object);
+//Returns every object cached by the calling thread to the depots and releases its magazines
+void Pool_Thread_Exit();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,359 @@
+#include <stdint.h>
+#include "SmallCache.h"
+#include "ChunkMap.h"
+#include "FreeBlockLList.h"
+#include "FreeBlockRecord.h"
+#include "util.h"
+
+#if defined(__x86_64__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+#endif
+
+void *__malloc_impl(size_t);
+size_t __alloc_run_impl(size_t, size_t, void **);
+void __free_impl(void *);
+void __memory_register_thread();
+
+enum Cache_Mode cache_mode = CACHE_OFF;
+
+struct Cache_Lists
+{
+    void *heads[NUM_SIZE_CLASSES];
+} __attribute__((aligned(64)));    //two CPUs never share a line of list heads
+
+static __thread struct Cache_Lists thread_cache;
+static __thread bool thread_cache_registered;    //the thread exit hook knows to empty thread_cache
+static struct Cache_Lists reserve_lists;    //heap lock held, linked through CACHE_NEXT like the caches
+
+#define CACHE_NEXT(object) (((void **) (object))[0])
+#define CACHE_DEPTH(object) (((size_t *) (object))[1])
+
+//Thread caches: plain singly linked lists, nobody else touches them
+
+static inline void *Thread_Cache_Pop(size_t size_class)
+{
+    void *object = thread_cache.heads[size_class];
+    if(object) thread_cache.heads[size_class] = CACHE_NEXT(object);
+    return object;
+}
+
+static inline bool Thread_Cache_Push(size_t size_class, void *object)
+{
+    void *head = thread_cache.heads[size_class];
+    size_t depth = head ? CACHE_DEPTH(head) + 1 : 1;
+    if(depth > CACHE_LIST_LIMIT) return false;
+    CACHE_NEXT(object) = head;
+    CACHE_DEPTH(object) = depth;
+    thread_cache.heads[size_class] = object;
+    return true;
+}
+
+//Every push that can leave objects in the thread cache goes through here: they only go back to the heap
+//when the thread exits, which it must hear about. Threads that only ever free need it as much as any
+static inline bool Thread_Cache_Push_Registered(size_t size_class, void *object)
+{
+    if(!Thread_Cache_Push(size_class, object)) return false;
+    if(!thread_cache_registered)
+    {
+        thread_cache_registered = true;    //first, registering may allocate and free
+        __memory_register_thread();
+    }
+    return true;
+}
+
+#ifdef HAVE_RSEQ
+
+//Per CPU caches. Every list operation is a restartable sequence: it checks it is still on the CPU whose list
+//it indexed and commits with a single store. If the thread is preempted, migrated or signalled in between,
+//the kernel sends it to the abort handler and we start over, so no atomics and no locks are needed.
+//The layout of the descriptor and the signature in front of the abort handler are fixed by the kernel ABI
+
+static struct Cache_Lists cpu_caches[MAX_CACHE_CPUS];
+
+#define RSEQ_CACHE_SIG 0x53053053    //glibc registers its rseq area with this signature on x86
+
+#define RSEQ_CS_START(cs_label, start_label, commit_label, abort_label) \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    #cs_label ":\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad " #start_label "f, (" #commit_label "f - " #start_label "f), " #abort_label "f\n\t" \
+    ".popsection\n\t" \
+    "leaq " #cs_label "b(%%rip), %%rax\n\t" \
+    "movq %%rax, %%fs:8(%[rseq_offset])\n\t" \
+    #start_label ":\n\t" \
+    "cmpl %[cpu], %%fs:4(%[rseq_offset])\n\t" \
+    "jnz " #abort_label "f\n\t"
+
+#define RSEQ_CS_ABORT(abort_label, c_label) \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    #abort_label ":\n\t" \
+    "jmp %l[" #c_label "]\n\t" \
+    ".popsection\n\t"
+
+static inline int Current_CPU()
+{
+    struct rseq *area = (struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+    return (int) __atomic_load_n(&area->cpu_id, __ATOMIC_RELAXED);
+}
+
+//Returns 0 with the object in *object_out, 1 if the list is empty, -1 if the sequence was aborted
+static inline int Rseq_Pop(void **head, void **object_out, int cpu)
+{
+    __asm__ __volatile__ goto(
+        RSEQ_CS_START(3, 1, 2, 4)
+        "movq %[head], %%rbx\n\t"
+        "testq %%rbx, %%rbx\n\t"
+        "jz %l[empty]\n\t"
+        "movq %%rbx, %[object]\n\t"
+        "movq (%%rbx), %%rbx\n\t"
+        "movq %%rbx, %[head]\n\t"    //commit
+        "2:\n\t"
+        RSEQ_CS_ABORT(4, aborted)
+        :
+        : [cpu] "r" (cpu), [rseq_offset] "r" (__rseq_offset), [head] "m" (*head), [object] "m" (*object_out)
+        : "memory", "cc", "rax", "rbx"
+        : aborted, empty);
+    return 0;
+aborted:
+    return -1;
+empty:
+    return 1;
+}
+
+//Returns 0 if pushed, 1 if the list is at CACHE_LIST_LIMIT, -1 if the sequence was aborted
+static inline int Rseq_Push(void **head, void *object, int cpu)
+{
+    __asm__ __volatile__ goto(
+        RSEQ_CS_START(3, 1, 2, 4)
+        "movq %[head], %%rbx\n\t"
+        "movq $1, %%rcx\n\t"
+        "testq %%rbx, %%rbx\n\t"
+        "jz 5f\n\t"
+        "movq 8(%%rbx), %%rcx\n\t"
+        "addq $1, %%rcx\n\t"
+        "5:\n\t"
+        "cmpq %[limit], %%rcx\n\t"
+        "ja %l[full]\n\t"
+        "movq %%rbx, (%[object])\n\t"
+        "movq %%rcx, 8(%[object])\n\t"
+        "movq %[object], %[head]\n\t"    //commit
+        "2:\n\t"
+        RSEQ_CS_ABORT(4, aborted)
+        :
+        : [cpu] "r" (cpu), [rseq_offset] "r" (__rseq_offset), [head] "m" (*head), [object] "r" (object), [limit] "i" (CACHE_LIST_LIMIT)
+        : "memory", "cc", "rax", "rbx", "rcx"
+        : aborted, full);
+    return 0;
+aborted:
+    return -1;
+full:
+    return 1;
+}
+
+static inline void *CPU_Cache_Pop(size_t size_class)
+{
+    void *object;
+    for(;;)
+    {
+        int cpu = Current_CPU();
+        if(cpu < 0 || cpu >= MAX_CACHE_CPUS) return Thread_Cache_Pop(size_class);
+        int result = Rseq_Pop(&cpu_caches[cpu].heads[size_class], &object, cpu);
+        if(result == 0) return object;
+        if(result == 1) return NULL;
+    }
+}
+
+static inline bool CPU_Cache_Push(size_t size_class, void *object)
+{
+    for(;;)
+    {
+        int cpu = Current_CPU();
+        if(cpu < 0 || cpu >= MAX_CACHE_CPUS) return Thread_Cache_Push_Registered(size_class, object);
+        int result = Rseq_Push(&cpu_caches[cpu].heads[size_class], object, cpu);
+        if(result >= 0) return result == 0;
+    }
+}
+
+static bool Rseq_Available()
+{
+    return __rseq_size > 0 && Current_CPU() >= 0;
+}
+
+#else
+
+static inline void *CPU_Cache_Pop(size_t size_class) {return Thread_Cache_Pop(size_class);}
+static inline bool CPU_Cache_Push(size_t size_class, void *object) {return Thread_Cache_Push_Registered(size_class, object);}
+static bool Rseq_Available() {return false;}
+
+#endif
+
+enum Cache_Mode Cache_Set_Mode(enum Cache_Mode mode)
+{
+    if(mode == CACHE_PERCPU && !Rseq_Available()) mode = CACHE_THREAD;
+    cache_mode = mode;
+    return mode;
+}
+
+static const char *cache_mode_names[] = {"off", "thread", "percpu"};
+
+bool Parse_Cache_Mode(const char *name, enum Cache_Mode *mode_out)
+{
+    for(int n = CACHE_OFF; n <= CACHE_PERCPU; n++)
+    {
+        if(comp_strings(name, cache_mode_names[n], 20) == 0)
+        {
+            *mode_out = n;
+            return true;
+        }
+    }
+    return false;
+}
+
+void *Cache_Alloc(size_t size)
+{
+    die_if_false(size && size <= SMALL_CACHE_MAX, "Cache_Alloc: size is not cacheable\n");
+    if(cache_mode == CACHE_PERCPU) return CPU_Cache_Pop(Size_Class_Of_Request(size));
+    return Thread_Cache_Pop(Size_Class_Of_Request(size));
+}
+
+bool Cache_Free(void *ptr, size_t size)
+{
+    size_t size_class;
+    struct LListRecord *llist = Chunk_Of_Block(ptr - FBR_HEADER_SIZE);
+    if(!llist) return false;    //not ours: its header may not even be mapped
+    if(llist->lifetime != LIFETIME_DEFAULT) return false;    //hinted blocks go back to their own chunks
+    if(size)
+    {
+        //Everything needed is in the chunk map and the LListRecord, the block header is never read
+        if(size > SMALL_CACHE_MAX) return false;
+        size_class = Size_Class_Of_Request(size);    //__malloc_impl rounded it up to this class
+    }
+    else
+    {
+        //Round down: a block always holds at least the class it is filed under
+        size_t data_size = Get_Data_Size(ptr - FBR_HEADER_SIZE);
+        if(data_size < SIZE_CLASS_GRANULE) return false;
+        size_class = data_size / SIZE_CLASS_GRANULE - 1;
+        if(size_class >= NUM_SIZE_CLASSES) return false;
+        if(Size_Class_Of_Request((size_class + 1) * SIZE_CLASS_GRANULE) != size_class) return false;    //no request maps here, it would never come back out
+    }
+
+    if(cache_mode == CACHE_PERCPU) return CPU_Cache_Push(size_class, ptr);
+    return Thread_Cache_Push_Registered(size_class, ptr);
+}
+
+size_t Cache_Refill_Batch(size_t size, void **batch)
+{
+    size_t class_size = (Size_Class_Of_Request(size) + 1) * SIZE_CLASS_GRANULE;
+    size_t n = 0;
+    while(n < CACHE_REFILL_BATCH && (batch[n] = Cache_Take_Reserved(size))) n++;
+    if(n) return n;
+    n = __alloc_run_impl(class_size, CACHE_REFILL_BATCH, batch);
+    if(n) return n;
+    batch[0] = __malloc_impl(class_size);    //no room for a whole run, one object still beats none
+    return batch[0] ? 1 : 0;
+}
+
+size_t Cache_Drain_Local(void **batch, size_t max)
+{
+    size_t n = 0;
+    void *object;
+    for(size_t size_class = 0; size_class < NUM_SIZE_CLASSES && n < max; size_class++)
+    {
+        while(n < max && (object = Thread_Cache_Pop(size_class)))
+            batch[n++] = object;
+        if(cache_mode == CACHE_PERCPU)
+            while(n < max && (object = CPU_Cache_Pop(size_class)))
+                batch[n++] = object;
+    }
+    return n;
+}
+
+size_t Cache_Shrink_CPU(int cpu, void **batch, size_t max)
+{
+    size_t n = 0;
+#ifdef HAVE_RSEQ
+    if(cache_mode != CACHE_PERCPU || Current_CPU() != cpu) return 0;
+    for(size_t size_class = 0; size_class < NUM_SIZE_CLASSES && n < max; size_class++)
+    {
+        //Only an object already popped is safe to look at, so the depth is read off each one as it comes out
+        void *object;
+        while(n < max && (object = CPU_Cache_Pop(size_class)))
+        {
+            if(CACHE_DEPTH(object) <= CACHE_LIST_LIMIT / 2)
+            {
+                if(!CPU_Cache_Push(size_class, object)) batch[n++] = object;    //refilled behind our back
+                break;
+            }
+            batch[n++] = object;
+        }
+    }
+#endif
+    return n;
+}
+
+void Cache_Thread_Exit()
+{
+    thread_cache_registered = false;    //later exit handlers may still free into it, and then it registers again
+    for(size_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++)
+    {
+        void *object;
+        while((object = Thread_Cache_Pop(size_class)))
+            __free_impl(object);
+    }
+}
+
+void Cache_Add_Reserved(size_t size_class, void **objects, size_t count)
+{
+    //Pushed last to first, so they come back out in address order
+    while(count--)
+    {
+        ((struct FreeBlockRecord *) (objects[count] - FBR_HEADER_SIZE))->flags |= FBR_RESERVED;
+        CACHE_NEXT(objects[count]) = reserve_lists.heads[size_class];
+        reserve_lists.heads[size_class] = objects[count];
+    }
+}
+
+void *Cache_Take_Reserved(size_t size)
+{
+    size_t size_class = Size_Class_Of_Request(size);
+    die_if_false(size_class < NUM_SIZE_CLASSES, "Cache_Take_Reserved: size is not cacheable\n");
+    void *object = reserve_lists.heads[size_class];
+    if(object) reserve_lists.heads[size_class] = CACHE_NEXT(object);
+    return object;
+}
+
+bool Cache_Return_Reserved(void *ptr)
+{
+    //Same rounding down as Cache_Free: the last block of a run can be bigger than its class
+    size_t size_class = Get_Data_Size(ptr - FBR_HEADER_SIZE) / SIZE_CLASS_GRANULE - 1;
+    if(size_class >= NUM_SIZE_CLASSES || Size_Class_Of_Request((size_class + 1) * SIZE_CLASS_GRANULE) != size_class) return false;
+    CACHE_NEXT(ptr) = reserve_lists.heads[size_class];
+    reserve_lists.heads[size_class] = ptr;
+    return true;
+}
+
+size_t Cache_Release_Reserved()
+{
+    size_t released = 0;
+    for(size_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++)
+    {
+        //Fill_Small_Reserves skips the classes no request maps to
+        if(Size_Class_Of_Request((size_class + 1) * SIZE_CLASS_GRANULE) != size_class) continue;
+        void *object;
+        while((object = reserve_lists.heads[size_class]))
+        {
+            reserve_lists.heads[size_class] = CACHE_NEXT(object);
+            ((struct FreeBlockRecord *) (object - FBR_HEADER_SIZE))->flags &= ~FBR_RESERVED;    //or it would come straight back
+            __free_impl(object);
+            released++;
+        }
+    }
+    return released;
+}
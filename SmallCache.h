@@ -0,0 +1,85 @@
+#ifndef SMALLCACHE_H
+#define SMALLCACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "FreeBlockRecord.h"
+
+//Caches of free small objects that malloc and free can use without the heap lock.
+//The objects stay allocated as far as their chunk is concerned; a cached object links to the next one
+//through its first word and keeps the length of the list from itself down in its second word
+
+#define SIZE_CLASS_GRANULE 16
+#define NUM_SIZE_CLASSES 16
+//__malloc_impl rounds anything up to this to a whole class
+#define SMALL_CACHE_MAX (SIZE_CLASS_GRANULE * NUM_SIZE_CLASSES)
+#define CACHE_LIST_LIMIT 64       //objects per class per cache, anything past that is freed for real
+#define CACHE_REFILL_BATCH 16
+#define MAX_CACHE_CPUS 256
+
+enum Cache_Mode
+{
+    CACHE_OFF,
+    CACHE_THREAD,    //one set of lists per thread
+    CACHE_PERCPU     //one set of lists per CPU, manipulated in rseq critical sections
+};
+
+extern enum Cache_Mode cache_mode;
+
+//Switch modes, before anything has been cached. CACHE_PERCPU falls back to CACHE_THREAD when the kernel
+//or libc does not give us rseq. Returns the mode actually in effect
+enum Cache_Mode Cache_Set_Mode(enum Cache_Mode mode);
+//Accepts off, thread and percpu. Returns false and leaves mode_out alone otherwise
+bool Parse_Cache_Mode(const char *name, enum Cache_Mode *mode_out);
+
+static inline size_t Size_Class_Of_Request(size_t size)
+{
+    return (size + SIZE_CLASS_GRANULE - 1) / SIZE_CLASS_GRANULE - 1;
+}
+
+//Small sizes are rounded to a whole size class, whether or not the caches are on. That way a block
+//handed out for a request always holds that request's class, and sized frees can file it without
+//reading its header.
+//Objects are not line sized one by one: the caches get theirs in runs that are line sized as a whole
+//(see Alloc_Run), which is enough to keep different threads' objects off each other's lines
+static inline size_t Round_Request_Size(size_t size)
+{
+    if(size > MAX_LLIST_SPACE) return size;    //fails for want of a chunk anyway, just do not wrap around
+    size_t granule = size <= SMALL_CACHE_MAX ? SIZE_CLASS_GRANULE : GRANULE_SIZE;
+    if(size % granule != 0)
+        size = size + granule - (size % granule);
+    return size;
+}
+
+//Lock free. size must be in 1..SMALL_CACHE_MAX. Returns NULL if the cache for its class is empty
+void *Cache_Alloc(size_t size);
+//Lock free. size is what the object was allocated with, which spares reading the block header, or 0 to read it from there
+//Returns false if the object does not belong in a cache, is not in one of our chunks at all, or the cache is full,
+//and the caller must free it for real
+bool Cache_Free(void *ptr, size_t size);
+
+//Heap lock held: allocate up to CACHE_REFILL_BATCH objects for requests of size, as one run private to the
+//caller's thread or CPU. Returns how many
+size_t Cache_Refill_Batch(size_t size, void **batch);
+//Lock free: take up to max objects out of the calling thread's cache and the current CPU's. Returns how many
+size_t Cache_Drain_Local(void **batch, size_t max);
+//Heap lock held: free every object in the calling thread's cache for real
+void Cache_Thread_Exit();
+//Lock free, for background maintenance once it has pinned itself to cpu: take objects out of that CPU's lists
+//that hold more than half of CACHE_LIST_LIMIT, down to half, so objects a CPU has stopped asking for go back
+//to the heap for the others. Returns how many, up to max. 0 if the thread is not on cpu or there are no per CPU caches
+size_t Cache_Shrink_CPU(int cpu, void **batch, size_t max);
+
+//Reserves: objects carved ahead of time by malloc_reserve, one list per size class, under the heap lock.
+//Cache_Refill_Batch takes from them first, and freeing one puts it back, so they never return to the
+//chunk's free list and it stays short. Refills take whole runs as long as nothing has come back
+//Heap lock held: add count objects of size_class, the blocks of one run, flagged FBR_RESERVED
+void Cache_Add_Reserved(size_t size_class, void **objects, size_t count);
+//Heap lock held: put a freed FBR_RESERVED object back. Returns false if it has no class to go back to
+bool Cache_Return_Reserved(void *ptr);
+//Heap lock held: one reserved object for a request of size, or NULL if its class has none left
+void *Cache_Take_Reserved(size_t size);
+//Heap lock held: free every reserved object for real. Returns how many there were
+size_t Cache_Release_Reserved();
+
+#endif
\ No newline at end of file
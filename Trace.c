@@ -0,0 +1,107 @@
+#ifdef MALLOC_TRACE
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "Trace.h"
+#include "FutexLock.h"
+#include "util.h"
+
+#define TRACE_RING_BYTES (sizeof(struct Trace_Ring_Header) + TRACE_RING_EVENTS * sizeof(struct Trace_Event))
+
+static __thread struct Trace_Ring_Header *trace_ring = NULL;
+static __thread bool trace_unavailable = false;    //setting up a ring failed once or is under way, do not retry
+static pthread_key_t trace_key;
+
+//Other thread exit destructors may still free memory after this one, their events are dropped
+static void Unmap_Ring_At_Exit(void *ring)
+{
+    trace_ring = NULL;
+    trace_unavailable = true;
+    munmap(ring, TRACE_RING_BYTES);
+}
+
+//A forked child would otherwise go on writing into its parent's file
+static void Forget_Ring_In_Child()
+{
+    if(trace_ring) munmap(trace_ring, TRACE_RING_BYTES);
+    trace_ring = NULL;
+}
+
+__attribute__((constructor))
+static void Trace_Init()
+{
+    pthread_key_create(&trace_key, Unmap_Ring_At_Exit);
+    pthread_atfork(NULL, NULL, Forget_Ring_In_Child);
+}
+
+static char *Append(char *to, const char *end, const char *from)
+{
+    while(*from && to < end - 1) *to++ = *from++;
+    *to = '\0';
+    return to;
+}
+
+//No snprintf, that may allocate
+static struct Trace_Ring_Header *Open_Ring()
+{
+    char path[512], number[32];
+    char *end = path + sizeof(path);
+    const char *dir = getenv("MALLOC_TRACE_DIR");
+    long pid = getpid(), tid = syscall(SYS_gettid);
+
+    char *at = Append(path, end, dir && *dir ? dir : "/tmp");
+    at = Append(at, end, "/" TRACE_FILE_PREFIX);
+    convert_integer(number, pid, 10, 0);
+    at = Append(at, end, number);
+    at = Append(at, end, ".");
+    convert_integer(number, tid, 10, 0);
+    Append(at, end, number);
+
+    int fd;
+    if(!open_file(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, &fd)) return NULL;
+    if(ftruncate(fd, TRACE_RING_BYTES) != 0)
+    {
+        close_file(fd);
+        return NULL;
+    }
+    struct Trace_Ring_Header *ring = mmap(NULL, TRACE_RING_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close_file(fd);
+    if(ring == MAP_FAILED) return NULL;
+
+    ring->magic = TRACE_MAGIC;
+    ring->version = TRACE_VERSION;
+    ring->capacity = TRACE_RING_EVENTS;
+    ring->pid = pid;
+    ring->tid = tid;
+    ring->written = 0;
+    pthread_setspecific(trace_key, ring);    //unmapped when the thread exits
+    return ring;
+}
+
+void Trace_Thread_Start()
+{
+    if(trace_ring || trace_unavailable) return;
+    trace_unavailable = true;    //pthread_setspecific may allocate, and so come back here
+    trace_ring = Open_Ring();
+    if(trace_ring) trace_unavailable = false;
+}
+
+void Trace_Record(uint32_t type, uint64_t a, uint64_t b)
+{
+    if(!trace_ring) return;
+
+    uint64_t n = trace_ring->written;
+    struct Trace_Event *event = (struct Trace_Event *) (trace_ring + 1) + n % TRACE_RING_EVENTS;
+    event->cycles = Read_Cycle_Counter();
+    event->type = type;
+    event->reserved = 0;
+    event->a = a;
+    event->b = b;
+    __atomic_store_n(&trace_ring->written, n + 1, __ATOMIC_RELEASE);    //someone reading a live ring never counts a half written event
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+//Binary event tracing for the allocator's slow paths. Build with -DMALLOC_TRACE to get it; without it every
+//MALLOC_TRACE_EVENT compiles to nothing and Trace.c is empty.
+//Each thread records into a ring of its own, a file mapped shared into the process, so nothing is lost if the
+//process dies and tools/trace_decode.c can read it afterwards. Only the owning thread ever writes a ring,
+//so recording an event takes no lock and no atomic read-modify-write.
+//Events are mostly recorded with the heap lock held, where opening a file or registering the ring for thread
+//exit could call back into malloc. So the ring is opened before the lock is taken, and a thread's events are
+//dropped until it first goes for the lock
+
+enum Trace_Event_Type
+{
+    TRACE_CHUNK_MAP = 1,     //a: LListRecord, b: bytes in the chunk
+    TRACE_CHUNK_UNMAP,       //a: LListRecord, b: bytes in the chunk
+    TRACE_SPLIT,             //a: block that was split, b: the data size it was cut down to
+    TRACE_COALESCE,          //a: block after merging with its neighbours, b: its data size
+    TRACE_PURGE,             //a: first byte given back, b: bytes given back
+    TRACE_LOCK_CONTENDED,    //a: lock, b: cycle counter ticks spent waiting for it
+    TRACE_FREE_UNKNOWN,      //a: pointer passed to free that is in no chunk
+    TRACE_NUM_EVENT_TYPES
+};
+
+#define TRACE_MAGIC 0x4543415254434c4dULL    //"MLCTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_EVENTS 65536              //per thread, which makes a 2MB file
+#define TRACE_FILE_PREFIX "malloc-trace."    //followed by pid.tid, in $MALLOC_TRACE_DIR or /tmp
+
+struct Trace_Event
+{
+    uint64_t cycles;    //Read_Cycle_Counter when it was recorded
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t a;
+    uint64_t b;
+};
+
+//Start of a ring file, followed by TRACE_RING_EVENTS events. Event n of the thread goes in slot n % capacity
+struct Trace_Ring_Header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t written;    //events recorded so far, all but the last capacity of them overwritten
+} __attribute__((aligned(64)));
+
+#ifdef MALLOC_TRACE
+//Opens the calling thread's ring if it has none yet. Must not be called with the heap lock held
+void Trace_Thread_Start();
+void Trace_Record(uint32_t type, uint64_t a, uint64_t b);
+#define MALLOC_TRACE_THREAD_START() Trace_Thread_Start()
+#define MALLOC_TRACE_EVENT(type, a, b) Trace_Record((type), (uint64_t) (a), (uint64_t) (b))
+#else
+#define MALLOC_TRACE_THREAD_START() ((void) 0)
+#define MALLOC_TRACE_EVENT(type, a, b) ((void) 0)
+#endif
+
+#endif
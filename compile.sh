@@ -1,2 +1,3 @@
 gcc -fPIC -c -Wall -O3 *.c -lpthread
-gcc -fPIC -shared -o memory.so *.o -lpthread -lrt -pthread
+g++ -fPIC -c -Wall -O3 *.cpp
+gcc -fPIC -shared -o memory.so *.o -lpthread -lrt -pthread -lstdc++
@@ -56,8 +56,12 @@
 #include <stddef.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include "ChunkMap.h"
 #include "FreeBlockLList.h"
 #include "FreeBlockRecord.h"
+#include "SmallCache.h"
+#include "Trace.h"
+#include "malloc_ext.h"
 #include "util.h"
 
 /* Predefined helper functions */
@@ -102,8 +106,9 @@ static void *__memcpy(void *dest, const void *src, size_t n) {
 
 #define MAX_LLISTS 500000
 struct LListRecord *llists[MAX_LLISTS] = {0};
+static size_t llists_end = 0;    //one past the highest slot in use, so background maintenance can stop there
 
-inline size_t Get_Empty_Index()
+static inline size_t Get_Empty_Index()
 {
   size_t n = 0;
   for(n = 0; n < MAX_LLISTS; n++)
@@ -113,16 +118,16 @@ inline size_t Get_Empty_Index()
   return -1;
 }
 
-//Try to alloc using existing llists
+//Try to alloc using existing llists of the given lifetime class
 //Messy pointer math due to the cost of this function (as shown by kcachgrind)
-inline void *Try_Alloc(size_t size)
+static inline void *Try_Alloc(size_t size, enum Lifetime_Class lifetime)
 {
   void *mem;
   struct LListRecord **current_llist;
   struct LListRecord **past_the_end = llists + MAX_LLISTS;
   for(current_llist = llists; current_llist < past_the_end; current_llist++)
   {
-    if(!(*current_llist)) continue;
+    if(!(*current_llist) || (*current_llist)->lifetime != lifetime) continue;
     mem = Alloc_Mem_Chunk_Of_Size(*current_llist, size);
     if(mem) return mem;
   }
@@ -133,33 +138,53 @@ inline void *Try_Alloc(size_t size)
 #define SIZE_OF_BOOKEEPING (sizeof(struct LListRecord) + sizeof(struct FreeBlockRecord))
 #define DEFAULT_LLIST_SIZE 262144
 
-inline size_t Calculate_MMap_Size(size_t requested_size)
+//Returns 0 if the request cannot fit in a single chunk
+static inline size_t Calculate_MMap_Size(size_t requested_size)
 {
+  if(requested_size > MAX_LLIST_SPACE - SIZE_OF_BOOKEEPING) return 0;
   requested_size += SIZE_OF_BOOKEEPING;
   if(requested_size < DEFAULT_LLIST_SIZE)
     requested_size = DEFAULT_LLIST_SIZE;
   return requested_size;
 }
 
-inline bool Find_Index_Of_LList_Containing_FBR(void *fbr, size_t *index)
+//Only needed to take a chunk out of llists, so a scan is fine
+static inline size_t Index_Of_LList(struct LListRecord *llist)
 {
-  void *block_start;
-  void *block_end;
   for(size_t n = 0; n < MAX_LLISTS; n++)
-  {
-    if(!llists[n]) continue;
-    block_start = (void*) llists[n] + sizeof(struct LListRecord);
-    block_end = (void*) llists[n] + llists[n]->size_of_mmap_chunk - sizeof(struct FreeBlockRecord);
-    if(block_start <= fbr && fbr <= block_end)
-    {
-      *index = n;
-      return true;
-    }
-  }
+    if(llists[n] == llist)
+      return n;
+  die_if_false(0==1, "Index_Of_LList: chunk is not in llists\n");
+  return -1;
+}
 
-  return false;
+//Take an empty chunk out of llists. Returns what munmap needs to give it back
+static struct Chunk_Mapping Detach_LList(size_t index)
+{
+  struct Chunk_Mapping mapping;
+
+  Flush_Unsorted_Blocks(llists[index]);   //nothing is live, so this coalesces the chunk back into one block
+  die_if_false(llists[index]->length == 1, "Detach_LList: chunk is not empty\n");   //the size no longer adds up exactly, Init_FBR drops the slop past the last granule
+  MALLOC_TRACE_EVENT(TRACE_CHUNK_UNMAP, llists[index], llists[index]->size_of_mmap_chunk);
+  mapping.start = (void*) llists[index] - llists[index]->mmap_offset;
+  mapping.length = llists[index]->size_of_mmap_chunk + llists[index]->mmap_offset;
+  Chunk_Map_Remove(mapping.start, mapping.length);
+  llists[index] = NULL;
+  while(llists_end > 0 && !llists[llists_end - 1]) llists_end--;
+  return mapping;
+}
+
+//Give an empty chunk back to the kernel
+static void Unmap_LList(size_t index)
+{
+  struct Chunk_Mapping mapping = Detach_LList(index);
+  munmap(mapping.start, mapping.length);
 }
 
+//Set while the background maintenance thread runs. Empty chunks then wait for it instead of being
+//unmapped by whoever freed their last block
+static bool background_maintenance = false;
+
 #define MAX(X, Y) (((X) < (Y)) ? (Y) : (X))
 #define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
@@ -169,31 +194,199 @@ inline bool Find_Index_Of_LList_Containing_FBR(void *fbr, size_t *index)
 
 void __free_impl(void *);
 
-void *__malloc_impl(size_t size) {
-  if(size == 0) return NULL;
-  if(size % 8 != 0)
-    size = size + 8 - (size % 8);
+//Chunks start on page boundaries, so without an offset every LListRecord and every first block would land in
+//the same few L1 sets. Each new chunk starts its record one cache line further into its first page
+#define CHUNK_COLOURS (PURGE_PAGE_SIZE / CACHE_LINE_SIZE)
+static size_t next_chunk_colour = 0;
 
+//Map a chunk of the lifetime class big enough for an allocation of needed bytes and register it in llists
+//map_flags go to mmap on top of the usual ones. Returns NULL if the request cannot fit in a chunk or mmap fails
+static struct LListRecord *Map_New_LList(size_t needed, enum Lifetime_Class lifetime, int map_flags)
+{
+  size_t colour = next_chunk_colour * CACHE_LINE_SIZE;
+  size_t calculated_size = needed <= MAX_LLIST_SPACE ? Calculate_MMap_Size(needed + colour) : 0;
+  if(!calculated_size) {errno = ENOMEM; return NULL;}
+  size_t index = Get_Empty_Index();
+  if(index == (size_t) -1) {errno = ENOMEM; return NULL;}
+
+  void *mem = mmap(NULL, calculated_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | map_flags, -1, 0);
+  if(mem == MAP_FAILED) {errno = ENOMEM; return NULL;}
+  next_chunk_colour = (next_chunk_colour + 1) % CHUNK_COLOURS;
+  llists[index] = mem + colour;
+  Init_LList(llists[index], calculated_size - colour);
+  llists[index]->mmap_offset = colour;
+  llists[index]->lifetime = lifetime;
+  if(!Chunk_Map_Insert(llists[index], mem, calculated_size)) {llists[index] = NULL; munmap(mem, calculated_size); errno = ENOMEM; return NULL;}
+  if(index >= llists_end) llists_end = index + 1;
+  MALLOC_TRACE_EVENT(TRACE_CHUNK_MAP, llists[index], llists[index]->size_of_mmap_chunk);
+  llists[index]->head->flags |= FBR_PURGED;   //a fresh anonymous mapping reads as zeros, even if it is populated
+  return llists[index];
+}
+
+//size is already rounded, alignment is more than a granule
+static void *Alloc_Aligned(size_t size, size_t alignment, enum Lifetime_Class lifetime)
+{
   void *retvalue;
-  retvalue = Try_Alloc(size);
-  if(retvalue) return retvalue;
+  struct LListRecord **past_the_end = llists + MAX_LLISTS;
+  for(struct LListRecord **current_llist = llists; current_llist < past_the_end; current_llist++)
+  {
+    if(!(*current_llist) || (*current_llist)->lifetime != lifetime) continue;
+    retvalue = Alloc_Aligned_Mem_Chunk(*current_llist, size, alignment);
+    if(retvalue) return retvalue;
+  }
 
-  write_string(STDERR_FILENO, "Mapping new llist\n", 50);
-  size_t index = Get_Empty_Index();
-  size_t calculated_size = Calculate_MMap_Size(size);
+  //worst case the aligned start sits alignment bytes in, behind a free block of its own
+  struct LListRecord *llist = Map_New_LList(size + alignment + sizeof(struct FreeBlockRecord), lifetime, 0);
+  if(!llist) return NULL;
+  retvalue = Alloc_Aligned_Mem_Chunk(llist, size, alignment);
+  die_if_false(retvalue, "retvalue is NULL\n");
+  return retvalue;
+}
 
-  llists[index] = mmap(NULL, calculated_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  die_if_false(llists[index], "mmap return NULL\n");
-  Init_LList(llists[index], calculated_size);
-  retvalue = Alloc_Mem_Chunk_Of_Size(llists[index], size);
+static void *Alloc_In_Class(size_t size, enum Lifetime_Class lifetime)
+{
+  void *retvalue;
+
+  if(size == 0) return NULL;
+  //With the caches on, reserves are handed out a run at a time by Cache_Refill_Batch instead
+  if(lifetime == LIFETIME_DEFAULT && cache_mode == CACHE_OFF && size <= SMALL_CACHE_MAX && (retvalue = Cache_Take_Reserved(size)))
+    return retvalue;
+  size = Round_Request_Size(size);
+  retvalue = Try_Alloc(size, lifetime);
+  if(retvalue) return retvalue;
+
+  struct LListRecord *llist = Map_New_LList(size, lifetime, 0);
+  if(!llist) return NULL;
+  retvalue = Alloc_Mem_Chunk_Of_Size(llist, size);
   die_if_false(retvalue, "retvalue is NULL\n");
   return retvalue;
 }
 
+//Zero the first size bytes of a block, leaving alone the pages that are still zero from mmap or a purge,
+//so they do not get faulted in either
+static void Zero_Block(void *mem, size_t size)
+{
+  void *clean_start, *clean_end;
+
+  if(!Find_Zeroed_Pages(mem, &clean_start, &clean_end) || clean_start >= mem + size)
+  {
+    __memset(mem, 0, size);
+    return;
+  }
+  __memset(mem, 0, clean_start - mem);
+  if(mem + size > clean_end)
+    __memset(clean_end, 0, mem + size - clean_end);
+}
+
+void *__malloc_impl(size_t size) {
+  return Alloc_In_Class(size, LIFETIME_DEFAULT);
+}
+
+//A lifetime hint sends the block to chunks of its own class. Cache_Free turns away blocks from those chunks, so
+//free hands them back there instead of letting a cache pass them on to unhinted callers. A hot block gets
+//whole cache lines to itself (see Line_Data_Size for what that costs). flags are already checked
+void *__malloc_hinted_impl(size_t size, unsigned flags) {
+  enum Lifetime_Class lifetime = LIFETIME_DEFAULT;
+  if(flags & MALLOC_HINT_SHORT_LIVED) lifetime = LIFETIME_SHORT;
+  if(flags & MALLOC_HINT_LONG_LIVED) lifetime = LIFETIME_LONG;
+
+  void *mem;
+  if((flags & MALLOC_HINT_HOT) && size != 0 && size <= MAX_LLIST_SPACE)
+    mem = Alloc_Aligned(Line_Data_Size(Round_Request_Size(size)), CACHE_LINE_SIZE, lifetime);
+  else
+    mem = Alloc_In_Class(size, lifetime);
+  if(!mem) return NULL;
+  if(flags & MALLOC_HINT_ZEROED) Zero_Block(mem, size);
+  return mem;
+}
+
+//alignment must be a power of two, anything up to the granule is what __malloc_impl gives anyway
+void *__aligned_alloc_impl(size_t alignment, size_t size) {
+  if(alignment <= GRANULE_SIZE) return __malloc_impl(size);
+  if(size == 0) return NULL;
+  if(size > MAX_LLIST_SPACE) {errno = ENOMEM; return NULL;}
+  return Alloc_Aligned(Round_Request_Size(size), alignment, LIFETIME_DEFAULT);
+}
+
+//count blocks of size bytes for a thread's or a CPU's cache, carved as one run of whole cache lines
+//so no other thread's objects share a line with them. Returns count, or 0 if there is no memory for the run
+size_t __alloc_run_impl(size_t size, size_t count, void **batch) {
+  size = Round_Request_Size(size);
+
+  struct LListRecord **past_the_end = llists + MAX_LLISTS;
+  for(struct LListRecord **current_llist = llists; current_llist < past_the_end; current_llist++)
+  {
+    if(!(*current_llist) || (*current_llist)->lifetime != LIFETIME_DEFAULT) continue;
+    if(Alloc_Run(*current_llist, size, count, batch)) return count;
+  }
+
+  struct LListRecord *llist = Map_New_LList(count * (size + FBR_HEADER_SIZE) + CACHE_LINE_SIZE + sizeof(struct FreeBlockRecord), LIFETIME_DEFAULT, 0);
+  if(!llist) return 0;
+  die_if_false(Alloc_Run(llist, size, count, batch), "__alloc_run_impl: run does not fit a fresh chunk\n");
+  return count;
+}
+
+//Write to every page of a fresh chunk
+static void Touch_Pages(struct LListRecord *llist)
+{
+  void *end = (void*) llist + llist->size_of_mmap_chunk;
+  for(volatile char *page = (void*) llist - llist->mmap_offset; (void*) page < end; page += PURGE_PAGE_SIZE)
+    *page = *page;    //a write faults the page in for real, a read would only map the zero page
+}
+
+//Carve up to bytes of ready objects out of llist for each small size class a request can map to, a cache
+//refill's worth at a time
+static void Fill_Small_Reserves(struct LListRecord *llist, size_t bytes)
+{
+  void *batch[CACHE_REFILL_BATCH];
+
+  for(size_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++)
+  {
+    size_t class_size = (size_class + 1) * SIZE_CLASS_GRANULE;
+    if(Size_Class_Of_Request(class_size) != size_class) continue;
+    size_t data_size = Round_Request_Size(class_size);
+    size_t run_bytes = CACHE_REFILL_BATCH * (data_size + FBR_HEADER_SIZE);
+    for(size_t carved = 0; carved + run_bytes <= bytes; carved += run_bytes)
+    {
+      if(!Alloc_Run(llist, data_size, CACHE_REFILL_BATCH, batch)) return;
+      Cache_Add_Reserved(size_class, batch, CACHE_REFILL_BATCH);
+    }
+  }
+}
+
+//The largest reserve chunk, leaving room for the bookkeeping and the worst cache colour
+#define MAX_RESERVE_CHUNK (MAX_LLIST_SPACE - SIZE_OF_BOOKEEPING - PURGE_PAGE_SIZE)
+
+//Map bytes of heap in chunks that stay mapped and resident: empty ones are not unmapped and free blocks in
+//them are not purged. Half of it is carved into ready objects, shared evenly among the small size classes in
+//use, the rest is left as free space for everything else. flags are already checked
+//Returns 0, or -1 with errno set to ENOMEM if a chunk could not be mapped. Whatever was mapped stays reserved
+int __malloc_reserve_impl(size_t bytes, unsigned flags) {
+  size_t small_classes = 0;
+  for(size_t size_class = 0; size_class < NUM_SIZE_CLASSES; size_class++)
+    if(Size_Class_Of_Request((size_class + 1) * SIZE_CLASS_GRANULE) == size_class) small_classes++;
+
+  while(bytes)
+  {
+    size_t needed = MIN(bytes, MAX_RESERVE_CHUNK);
+    struct LListRecord *llist = Map_New_LList(needed, LIFETIME_DEFAULT, (flags & MALLOC_RESERVE_POPULATE) ? MAP_POPULATE : 0);
+    if(!llist) return -1;
+    llist->reserved = true;
+    if(flags & MALLOC_RESERVE_TOUCH) Touch_Pages(llist);
+    Fill_Small_Reserves(llist, needed / 2 / small_classes);
+    bytes -= needed;
+  }
+  return 0;
+}
+
 void *__calloc_impl(size_t nmemb, size_t size) {
-  void *mem = __malloc_impl(nmemb * size);
-  __memset(mem, 0, nmemb * size);
-  return mem;  
+  size_t total;
+
+  if(__builtin_mul_overflow(nmemb, size, &total)) {errno = ENOMEM; return NULL;}
+  void *mem = __malloc_impl(total);
+  if(!mem) return NULL;
+  Zero_Block(mem, total);
+  return mem;
 }
 
 void *__realloc_impl(void *ptr, size_t size) {
@@ -209,10 +402,11 @@ void *__realloc_impl(void *ptr, size_t size) {
     return NULL;
   }
   
-  size_t *old_size = ptr - sizeof(size_t);
+  size_t old_size = Get_Data_Size(ptr - FBR_HEADER_SIZE);
 
   mem = __malloc_impl(size);
-  __memcpy(mem, ptr, MIN(*old_size, size));
+  if(!mem) return NULL;    //errno is set, and the old block stays as it was
+  __memcpy(mem, ptr, MIN(old_size, size));
   __free_impl(ptr);
   return mem;
 }
@@ -220,22 +414,153 @@ void *__realloc_impl(void *ptr, size_t size) {
 void __free_impl(void *ptr) {
   if(!ptr) return;
 
-  struct FreeBlockRecord *fbr = ptr - sizeof(size_t);
-  size_t llist_index;
-  
-  if(!Find_Index_Of_LList_Containing_FBR(fbr, &llist_index)) {write_string(STDERR_FILENO, "__free_impl: Cannot find llist containing pointer. Ignoring.\n", 80); return;}
+  struct FreeBlockRecord *fbr = ptr - FBR_HEADER_SIZE;
+  struct LListRecord *llist = Chunk_Of_Block(fbr);
+
+  if(!llist) {MALLOC_TRACE_EVENT(TRACE_FREE_UNKNOWN, ptr, 0); return;}    //not ours, ignore it
+  if((fbr->flags & FBR_RESERVED) && llist->reserved && Cache_Return_Reserved(ptr)) return;    //back to its size class reserve
+
+  Free_Mem_Chunk(llist, ptr);
+  if(llist->num_allocated != 0 || llist->reserved || background_maintenance) return;
+
+  Unmap_LList(Index_Of_LList(llist));
+}
+
+/* End of the actual malloc/calloc/realloc/free functions */
+
+/* Background maintenance, called with the lock held */
+
+void __malloc_set_maintenance_impl(bool on) {
+  background_maintenance = on;
+  Set_Deferred_Purging(on);
+}
+
+//One step of background maintenance. Looks at up to MAINTENANCE_STEP_SLOTS slots of llists from *cursor on,
+//and at most MAINTENANCE_STEP_CHUNKS chunks among them, so the lock is never held for long: their unsorted
+//lists are coalesced and their large free blocks purged, and chunks that were already empty on the last pass
+//are taken out of the heap. Their mappings go in released, for the caller to unmap once it has dropped the lock
+//Returns how many. *cursor goes back to 0 once it is past the highest slot in use
+size_t __malloc_maintain_impl(size_t *cursor, struct Chunk_Mapping *released) {
+  size_t visited = 0, count = 0;
 
-  Free_Mem_Chunk(llists[llist_index], ptr);
-  if(llists[llist_index]->length == 1)
+  for(size_t slots = 0; slots < MAINTENANCE_STEP_SLOTS && visited < MAINTENANCE_STEP_CHUNKS && *cursor < llists_end; slots++, (*cursor)++)
   {
-    if(llists[llist_index]->size_of_mmap_chunk - llists[llist_index]->head->data_size - sizeof(size_t) == sizeof(struct LListRecord))
+    struct LListRecord *llist = llists[*cursor];
+    if(!llist) continue;
+    visited++;
+    Flush_Unsorted_Blocks(llist);
+    if(llist->num_allocated == 0 && !llist->reserved)
     {
-      write_string(STDERR_FILENO, "Unmapping empty llist\n", 50);
-      munmap(llists[llist_index], llists[llist_index]->size_of_mmap_chunk);
-      llists[llist_index] = NULL;
+      if(llist->idle) released[count++] = Detach_LList(*cursor);
+      else llist->idle = true;    //no point purging what is likely to be unmapped next time
+      continue;
     }
+    llist->idle = false;
+    Purge_Large_Free_Blocks(llist);
   }
+  if(*cursor >= llists_end) *cursor = 0;
+  return count;
 }
 
-/* End of the actual malloc/calloc/realloc/free functions */
+/* Introspection, called with the lock held. None of it allocates */
+
+//Trimming gives up the reserves as well, they would keep their chunks mapped and resident
+int __malloc_trim_impl(size_t pad) {
+  size_t released = 0;
+  Cache_Release_Reserved();
+  for(size_t n = 0; n < MAX_LLISTS; n++)
+  {
+    if(!llists[n]) continue;
+    llists[n]->reserved = false;
+    Flush_Unsorted_Blocks(llists[n]);
+    if(llists[n]->num_allocated == 0)
+    {
+      released += llists[n]->size_of_mmap_chunk;
+      Unmap_LList(n);
+      continue;
+    }
+    released += Purge_All_Free_Blocks(llists[n], &pad);
+  }
+  return released != 0;
+}
+
+int __malloc_walk_impl(malloc_walk_callback callback, void *arg) {
+  struct malloc_walk_entry entry;
+  int stop;
+
+  for(size_t n = 0; n < MAX_LLISTS; n++)
+  {
+    if(!llists[n]) continue;
+    entry.chunk = llists[n];
+    entry.chunk_size = llists[n]->size_of_mmap_chunk;
+    entry.block = NULL;
+    entry.data_size = 0;
+    entry.is_free = 0;
+    if((stop = callback(&entry, arg))) return stop;
+
+    for(struct FreeBlockRecord *fbr = First_Block(llists[n]); fbr; fbr = Next_Block(llists[n], fbr))
+    {
+      entry.block = (void*) fbr + FBR_HEADER_SIZE;
+      entry.data_size = Get_Data_Size(fbr);
+      entry.is_free = (fbr->flags & FBR_FREE) != 0;
+      if((stop = callback(&entry, arg))) return stop;
+    }
+  }
+  return 0;
+}
+
+//One name/value pair: name="value" in XML, "name": value in JSON
+static void Write_Info_Field(int fd, bool json, bool first, const char *name, size_t value)
+{
+  if(json) write_strings(fd, 100, 4, first ? "\"" : ", \"", name, "\"", ": ");
+  else write_strings(fd, 100, 3, " ", name, "=\"");
+  write_int(fd, value, 10, 0);
+  if(!json) write_string(fd, "\"", 2);
+}
+
+void __malloc_info_impl(int fd, bool json, const struct malloc_lock_stats *lock_stats) {
+  struct LList_Stats stats;
+  size_t chunks = 0, mapped = 0, allocated_blocks = 0, free_bytes = 0;
+
+  write_string(fd, json ? "{\"chunks\": [" : "<malloc version=\"1\">\n", 50);
+  for(size_t n = 0; n < MAX_LLISTS; n++)
+  {
+    if(!llists[n]) continue;
+    Get_LList_Stats(llists[n], &stats);
+
+    write_string(fd, json ? (chunks ? ",\n  {" : "\n  {") : "<chunk", 10);
+    Write_Info_Field(fd, json, true, "index", n);
+    if(json) write_string(fd, ", \"address\": \"0x", 20);
+    else write_string(fd, " address=\"0x", 20);
+    write_int(fd, (long) llists[n], 16, 0);
+    write_string(fd, "\"", 2);
+    Write_Info_Field(fd, json, false, "size", llists[n]->size_of_mmap_chunk);
+    Write_Info_Field(fd, json, false, "lifetime", llists[n]->lifetime);
+    Write_Info_Field(fd, json, false, "reserved", llists[n]->reserved);
+    Write_Info_Field(fd, json, false, "allocated_blocks", llists[n]->num_allocated);
+    Write_Info_Field(fd, json, false, "free_blocks", stats.free_blocks);
+    Write_Info_Field(fd, json, false, "free_list_length", llists[n]->length);
+    Write_Info_Field(fd, json, false, "unsorted_length", llists[n]->unsorted_length);
+    Write_Info_Field(fd, json, false, "free_bytes", stats.free_bytes);
+    Write_Info_Field(fd, json, false, "largest_free", stats.largest_free);
+    Write_Info_Field(fd, json, false, "purged_blocks", stats.purged_blocks);
+    write_string(fd, json ? "}" : "/>\n", 5);
+
+    chunks++;
+    mapped += llists[n]->size_of_mmap_chunk;
+    allocated_blocks += llists[n]->num_allocated;
+    free_bytes += stats.free_bytes;
+  }
+
+  write_string(fd, json ? "],\n \"total\": {" : "<total", 20);
+  Write_Info_Field(fd, json, true, "chunks", chunks);
+  Write_Info_Field(fd, json, false, "mapped", mapped);
+  Write_Info_Field(fd, json, false, "allocated_blocks", allocated_blocks);
+  Write_Info_Field(fd, json, false, "free_bytes", free_bytes);
+  write_string(fd, json ? "},\n \"lock\": {" : "/>\n<lock", 20);
+  Write_Info_Field(fd, json, true, "acquisitions", lock_stats->acquisitions);
+  Write_Info_Field(fd, json, false, "contended_acquisitions", lock_stats->contended_acquisitions);
+  Write_Info_Field(fd, json, false, "wait_cycles", lock_stats->wait_cycles);
+  write_string(fd, json ? "}}\n" : "/>\n</malloc>\n", 20);
+}
 
@@ -0,0 +1,91 @@
+/*
+    Extensions exported by memory.so beyond the standard allocation
+    functions. Object pools have their own header, pool.h.
+*/
+
+#ifndef MALLOC_EXT_H
+#define MALLOC_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Counters of the heap lock since the process started. A contended
+   acquisition is one that had to spin or sleep; wait_cycles adds up
+   how long those waited, in cycle counter ticks (nanoseconds where
+   there is no cycle counter). */
+struct malloc_lock_stats {
+  uint64_t acquisitions;
+  uint64_t contended_acquisitions;
+  uint64_t wait_cycles;
+};
+
+void malloc_lock_stats(struct malloc_lock_stats *stats);
+
+/* Hints for malloc_hinted. Short and long lived objects each get
+   chunks of their own, so a burst of short lived garbage frees whole
+   chunks instead of leaving holes around the odd long lived object.
+   SHORT_LIVED and LONG_LIVED exclude each other. */
+#define MALLOC_HINT_SHORT_LIVED 0x1
+#define MALLOC_HINT_LONG_LIVED 0x2
+#define MALLOC_HINT_ZEROED 0x4      /* clear the memory, as calloc does */
+#define MALLOC_HINT_HOT 0x8         /* give it at least a cache line of its own */
+
+/* malloc with hints. Flags 0 is plain malloc. The memory is freed
+   with free like any other; realloc moves it back among unhinted
+   objects. Returns NULL with errno set to EINVAL for unknown or
+   conflicting flags. */
+void *malloc_hinted(size_t size, unsigned flags);
+
+/* Flags for malloc_reserve */
+#define MALLOC_RESERVE_POPULATE 0x1   /* map with MAP_POPULATE, the kernel faults it all in */
+#define MALLOC_RESERVE_TOUCH 0x2      /* write to every page, for kernels that ignore MAP_POPULATE */
+
+/* Maps bytes of heap right away, so that the allocations that follow
+   need no mmap. Reserved chunks stay mapped when they empty and their
+   free pages are never purged. Half of the reserve is carved into
+   ready objects for the small size classes, shared evenly among them,
+   the rest is free space for any request. With either flag the pages
+   are faulted in now instead of on first use. Setting MEMORY_RESERVE
+   to a size, with an optional k, m or g suffix and an optional
+   :populate or :touch, reserves when the library is loaded. Returns
+   0, or -1 with errno set to EINVAL for unknown flags or ENOMEM. */
+int malloc_reserve(size_t bytes, unsigned flags);
+
+/* Gives memory back to the kernel right away: the calling thread's
+   and CPU's small object caches and any reserve are emptied, every
+   chunk with nothing allocated in it is unmapped and the free pages of
+   every other chunk are purged, except for roughly the first pad
+   bytes of free space. Returns 1 if anything was released, 0
+   otherwise. */
+int malloc_trim(size_t pad);
+
+/* One step of a heap walk. Each chunk is announced with block NULL,
+   followed by every block in it in address order. Objects sitting in
+   a small object cache, a reserve or a pool count as allocated. */
+struct malloc_walk_entry {
+  void *chunk;
+  size_t chunk_size;
+  void *block;          /* the address malloc returned or would return */
+  size_t data_size;
+  int is_free;
+};
+
+/* Return non zero to stop the walk */
+typedef int (*malloc_walk_callback)(const struct malloc_walk_entry *entry, void *arg);
+
+/* Calls callback for every chunk and every block. The heap lock is
+   held throughout, so the callback must not allocate or free. Returns
+   0, or whatever non zero value stopped the walk. */
+int malloc_walk(malloc_walk_callback callback, void *arg);
+
+#define MALLOC_INFO_XML 0
+#define MALLOC_INFO_JSON 1
+
+/* Writes per chunk occupancy and free list lengths, the totals and
+   the lock counters to fp, as XML or JSON. The report goes straight
+   to the file descriptor, nothing is allocated. Returns 0, or -1 with
+   errno set to EINVAL for a bad fp or options. */
+int malloc_info(int options, FILE *fp);
+
+#endif
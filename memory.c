@@ -31,6 +31,34 @@
     but you don't need the debug messages, set MEMORY_DEBUG to no
     before starting the process.
 
+    Set MEMORY_PLACEMENT to first_fit, next_fit, best_fit or good_fit
+    to choose how free blocks are picked (first_fit by default). The
+    placement simulator in tools/placement_sim.c compares the policies
+    on a recorded allocation trace.
+
+    Set MEMORY_CACHE to thread or percpu to serve small requests from
+    lock free caches of recently freed objects. percpu keeps one cache
+    per CPU using restartable sequences and falls back to per thread
+    caches where the kernel or libc does not provide them.
+
+    Set MEMORY_MAINTENANCE to an interval in milliseconds to move
+    housekeeping onto a background thread that wakes up that often:
+    it coalesces deferred frees, purges large free blocks, unmaps
+    chunks that have stayed empty for a whole interval and, with
+    MEMORY_CACHE=percpu, hands objects piled up in one CPU's cache back
+    to the heap. Frees then never purge or unmap by themselves.
+
+    Set MEMORY_RESERVE to a size such as 64m to map that much heap
+    when the library is loaded, so the first allocations need no mmap.
+    Append :populate or :touch to fault it all in right away as well.
+    See malloc_reserve in malloc_ext.h.
+
+    Add -DMALLOC_TRACE to the gcc lines in compile.sh to record chunk
+    maps and unmaps, splits, coalesces, purges and lock contention into
+    per thread ring files in $MALLOC_TRACE_DIR (/tmp by default).
+    tools/trace_decode.c prints them. Without the flag the trace points
+    compile to nothing.
+
     You do not need to change anything in this file. You don't need to
     understand this file but it may be a good learning exercise to
     understand it. Your actual implementation goes into the file
@@ -74,26 +102,50 @@
 
 */
 
+#define _GNU_SOURCE
+
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "FreeBlockLList.h"
+#include "FutexLock.h"
+#include "malloc_ext.h"
+#include "ObjectPool.h"
+#include "SmallCache.h"
+#include "pool.h"
 
 
 void *__malloc_impl(size_t);
 void *__calloc_impl(size_t, size_t);
 void *__realloc_impl(void *, size_t);
+void *__aligned_alloc_impl(size_t, size_t);
 void __free_impl(void *);
+void *__malloc_hinted_impl(size_t, unsigned);
+int __malloc_reserve_impl(size_t, unsigned);
+int __malloc_trim_impl(size_t);
+void __malloc_set_maintenance_impl(bool);
+size_t __malloc_maintain_impl(size_t *, struct Chunk_Mapping *);
+int __malloc_walk_impl(malloc_walk_callback, void *);
+void __malloc_info_impl(int, bool, const struct malloc_lock_stats *);
 
 static int __memory_print_debug_running = 0;
 static int __memory_print_debug_init_running = 0;
 static int __memory_print_debug_initialized = 0;
 static int __memory_print_debug_do_it = 0;
 
-static pthread_mutex_t memory_management_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Futex_Lock memory_management_lock = FUTEX_LOCK_INITIALIZER;
 static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_exit_key;
+static pthread_once_t thread_exit_key_once = PTHREAD_ONCE_INIT;
 
 static void __memory_print_debug_init() {
   char *env_var;
@@ -132,40 +184,603 @@ static void __memory_print_debug(const char *fmt, ...) {
   pthread_mutex_unlock(&print_lock);
 }
 
+/* Picks the placement policy from MEMORY_PLACEMENT (first_fit,
+   next_fit, best_fit or good_fit) when the library is loaded. Anything
+   else keeps first fit. */
+__attribute__((constructor)) static void __memory_placement_init() {
+  char *env_var;
+  enum Placement_Policy policy;
+
+  env_var = getenv("MEMORY_PLACEMENT");
+  if (env_var == NULL) return;
+  if (!Parse_Placement_Policy(env_var, &policy)) return;
+  Futex_Lock_Acquire(&memory_management_lock);
+  Set_Placement_Policy(policy);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+/* Picks the small object cache from MEMORY_CACHE (off, thread or
+   percpu) when the library is loaded. percpu needs rseq and falls
+   back to thread caches without it. The default is off. */
+__attribute__((constructor)) static void __memory_cache_init() {
+  char *env_var;
+  enum Cache_Mode mode;
+
+  env_var = getenv("MEMORY_CACHE");
+  if (env_var == NULL) return;
+  if (!Parse_Cache_Mode(env_var, &mode)) return;
+  Futex_Lock_Acquire(&memory_management_lock);
+  Cache_Set_Mode(mode);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+/* Reads MEMORY_RESERVE, a size with an optional k, m or g suffix and
+   an optional :populate or :touch. Returns 0 if it does not parse. */
+static int __memory_parse_reserve(const char *text, size_t *bytes, unsigned *flags) {
+  char *end;
+  unsigned long long n;
+
+  if (*text < '0' || *text > '9') return 0;
+  n = strtoull(text, &end, 10);
+  switch (*end) {
+  case 'g': case 'G': n <<= 10; /* fall through */
+  case 'm': case 'M': n <<= 10; /* fall through */
+  case 'k': case 'K': n <<= 10; end++; break;
+  }
+  *flags = 0;
+  if (!strcmp(end, ":populate")) *flags = MALLOC_RESERVE_POPULATE;
+  else if (!strcmp(end, ":touch")) *flags = MALLOC_RESERVE_TOUCH;
+  else if (*end != '\0') return 0;
+  *bytes = n;
+  return 1;
+}
+
+/* Reserves heap from MEMORY_RESERVE when the library is loaded.
+   Nothing is reserved if it is not set or does not parse. */
+__attribute__((constructor)) static void __memory_reserve_init() {
+  char *env_var;
+  size_t bytes;
+  unsigned flags;
+
+  env_var = getenv("MEMORY_RESERVE");
+  if (env_var == NULL) return;
+  if (!__memory_parse_reserve(env_var, &bytes, &flags)) return;
+  malloc_reserve(bytes, flags);
+}
+
+/* Background maintenance. The thread runs on a small stack of its own
+   and holds the lock for one __malloc_maintain_impl step at a time, so
+   application threads never wait behind a whole pass over the heap.
+   Chunks it takes out of the heap are unmapped after the lock is
+   dropped. */
+
+#define MAINTENANCE_STACK_SIZE (256 * 1024)
+
+static struct timespec __maintenance_interval;
+
+/* Per CPU caches can only be touched from their own CPU, so the thread
+   pins itself to each CPU it may run on in turn */
+static void __maintenance_rebalance_caches() {
+  void *batch[CACHE_REFILL_BATCH];
+  cpu_set_t allowed, one;
+  size_t n, count;
+  int cpu;
+
+  if (cache_mode != CACHE_PERCPU) return;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) return;
+  for (cpu = 0; cpu < MAX_CACHE_CPUS && cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed)) continue;
+    CPU_ZERO(&one);
+    CPU_SET(cpu, &one);
+    if (sched_setaffinity(0, sizeof(one), &one) != 0) continue;
+    while ((count = Cache_Shrink_CPU(cpu, batch, CACHE_REFILL_BATCH)) != 0) {
+      Futex_Lock_Acquire(&memory_management_lock);
+      for (n = 0; n < count; n++) __free_impl(batch[n]);
+      Futex_Lock_Release(&memory_management_lock);
+    }
+  }
+  sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+static void *__maintenance_thread(void *unused) {
+  struct Chunk_Mapping released[MAINTENANCE_STEP_CHUNKS];
+  size_t n, count, cursor = 0;
+
+  for (;;) {
+    nanosleep(&__maintenance_interval, NULL);
+    do {
+      Futex_Lock_Acquire(&memory_management_lock);
+      count = __malloc_maintain_impl(&cursor, released);
+      Futex_Lock_Release(&memory_management_lock);
+      for (n = 0; n < count; n++) munmap(released[n].start, released[n].length);
+    } while (cursor != 0);
+    __maintenance_rebalance_caches();
+  }
+  return NULL;
+}
+
+/* Starts the maintenance thread if MEMORY_MAINTENANCE is set to a
+   positive number of milliseconds. pthread_create may allocate, so it
+   is called outside the lock; the thread blocks every signal, they are
+   the application's business. */
+__attribute__((constructor)) static void __memory_maintenance_init() {
+  char *env_var, *end;
+  long interval;
+  void *stack;
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+  int started;
+
+  env_var = getenv("MEMORY_MAINTENANCE");
+  if (env_var == NULL) return;
+  interval = strtol(env_var, &end, 10);
+  if (end == env_var || *end != '\0' || interval <= 0) return;
+  __maintenance_interval.tv_sec = interval / 1000;
+  __maintenance_interval.tv_nsec = (interval % 1000) * 1000000;
+
+  stack = mmap(NULL, MAINTENANCE_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) return;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, stack, MAINTENANCE_STACK_SIZE);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  Futex_Lock_Acquire(&memory_management_lock);
+  __malloc_set_maintenance_impl(true);
+  Futex_Lock_Release(&memory_management_lock);
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  started = pthread_create(&thread, &attr, __maintenance_thread, NULL) == 0;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+
+  if (!started) {
+    Futex_Lock_Acquire(&memory_management_lock);
+    __malloc_set_maintenance_impl(false);
+    Futex_Lock_Release(&memory_management_lock);
+    munmap(stack, MAINTENANCE_STACK_SIZE);
+    return;
+  }
+}
+
+/* fork copies the heap as it is at that instant. Holding the lock
+   across it means no other thread, the maintenance thread included, is
+   halfway through changing it, and the child does not inherit a lock
+   whose owner does not exist there. The child has no maintenance
+   thread either, so it goes back to doing its housekeeping inline */
+static void __memory_fork_prepare() {
+  Futex_Lock_Acquire(&memory_management_lock);
+}
+
+static void __memory_fork_parent() {
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+static void __memory_fork_child() {
+  __malloc_set_maintenance_impl(false);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+/* pthread_atfork may allocate, so it is called outside the lock */
+__attribute__((constructor)) static void __memory_fork_init() {
+  pthread_atfork(__memory_fork_prepare, __memory_fork_parent, __memory_fork_child);
+}
+
+/* Threads that have cached anything register with this key, so that
+   __memory_thread_exit gets to hand their pool magazines and thread
+   cache back when they go away. Any non NULL value will do. */
+
+static void __memory_thread_exit(void *unused) {
+  Futex_Lock_Acquire(&memory_management_lock);
+  Pool_Thread_Exit();
+  Cache_Thread_Exit();
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+static void __memory_thread_key_init() {
+  pthread_key_create(&thread_exit_key, __memory_thread_exit);
+}
+
+/* Called outside the lock, pthread_setspecific may allocate. The
+   thread cache calls this the first time it takes an object, whether
+   from a refill or a free */
+void __memory_register_thread() {
+  pthread_once(&thread_exit_key_once, __memory_thread_key_init);
+  if (pthread_getspecific(thread_exit_key) == NULL)
+    pthread_setspecific(thread_exit_key, (void *) 1);
+}
+
+/* The small object cache for size ran dry: allocate a batch under the
+   lock, keep one and cache the rest outside of it */
+static void *__cache_refill(size_t size) {
+  void *batch[CACHE_REFILL_BATCH];
+  size_t n, count, overflow;
+
+  Futex_Lock_Acquire(&memory_management_lock);
+  count = Cache_Refill_Batch(size, batch);
+  Futex_Lock_Release(&memory_management_lock);
+  if (count == 0) return NULL;
+
+  /* batch[0] goes to the caller, what the cache will not take is
+     packed in after it */
+  overflow = 1;
+  for (n = 1; n < count; n++)
+    if (!Cache_Free(batch[n], size)) batch[overflow++] = batch[n];
+  if (overflow > 1) {
+    Futex_Lock_Acquire(&memory_management_lock);
+    for (n = 1; n < overflow; n++) __free_impl(batch[n]);
+    Futex_Lock_Release(&memory_management_lock);
+  }
+  return batch[0];
+}
+
 void *malloc(size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  if (cache_mode != CACHE_OFF && size != 0 && size <= SMALL_CACHE_MAX) {
+    ptr = Cache_Alloc(size);
+    if (ptr == NULL) ptr = __cache_refill(size);
+    return ptr;
+  }
+  Futex_Lock_Acquire(&memory_management_lock);
   ptr = __malloc_impl(size);
   //__memory_print_debug("malloc(0x%zx) = %p\n", size, ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  Futex_Lock_Release(&memory_management_lock);
   return ptr;
 }
 
 void *calloc(size_t nmemb, size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  Futex_Lock_Acquire(&memory_management_lock);
   ptr = __calloc_impl(nmemb, size);
   //__memory_print_debug("calloc(0x%zx, 0x%zx) = %p\n", nmemb, size, ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  Futex_Lock_Release(&memory_management_lock);
   return ptr;
 }
 
 void *realloc(void *old_ptr, size_t size) {
   void *ptr;
 
-  pthread_mutex_lock(&memory_management_lock);
+  Futex_Lock_Acquire(&memory_management_lock);
   ptr = __realloc_impl(old_ptr, size);
   //__memory_print_debug("realloc(%p, 0x%zx) = %p\n", old_ptr, size, ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  Futex_Lock_Release(&memory_management_lock);
   return ptr;
 }
 
 void free(void *ptr) {
-  pthread_mutex_lock(&memory_management_lock);
+  if (ptr == NULL) return;
+  if (cache_mode != CACHE_OFF && Cache_Free(ptr, 0)) return;
+  Futex_Lock_Acquire(&memory_management_lock);
   __free_impl(ptr);
   //__memory_print_debug("free(%p)\n", ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+static int __is_power_of_two(size_t n) {
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  void *ptr;
+
+  if (!__is_power_of_two(alignment)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  Futex_Lock_Acquire(&memory_management_lock);
+  ptr = __aligned_alloc_impl(alignment, size);
+  Futex_Lock_Release(&memory_management_lock);
+  return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+  return aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+
+  if (!__is_power_of_two(alignment) || alignment % sizeof(void *) != 0)
+    return EINVAL;
+  Futex_Lock_Acquire(&memory_management_lock);
+  ptr = __aligned_alloc_impl(alignment, size);
+  Futex_Lock_Release(&memory_management_lock);
+  if (ptr == NULL && size != 0) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+/* Entry points for the C++ operators in memory_cxx.cpp. They go
+   straight to the implementation, the operators do the new_handler
+   and exception dance themselves. alignment 0 means the default. */
+
+void *__memory_new(size_t size, size_t alignment) {
+  void *ptr;
+
+  if (cache_mode != CACHE_OFF && !alignment && size <= SMALL_CACHE_MAX) {
+    ptr = Cache_Alloc(size);
+    if (ptr == NULL) ptr = __cache_refill(size);
+    return ptr;
+  }
+  Futex_Lock_Acquire(&memory_management_lock);
+  ptr = alignment ? __aligned_alloc_impl(alignment, size) : __malloc_impl(size);
+  Futex_Lock_Release(&memory_management_lock);
+  return ptr;
+}
+
+/* size 0 means the size is not known. A known size picks the cache
+   class without reading the block header. Freeing under the lock needs
+   the header anyway, so the size goes no further than the cache */
+void __memory_delete(void *ptr, size_t size) {
+  if (ptr == NULL) return;
+  if (cache_mode != CACHE_OFF && Cache_Free(ptr, size)) return;
+  Futex_Lock_Acquire(&memory_management_lock);
+  __free_impl(ptr);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+/* Object pools */
+
+struct Object_Pool *pool_create(size_t size, size_t alignment) {
+  struct Object_Pool *pool;
+
+  Futex_Lock_Acquire(&memory_management_lock);
+  pool = Pool_Create(size, alignment);
+  Futex_Lock_Release(&memory_management_lock);
+  return pool;
+}
+
+void pool_destroy(struct Object_Pool *pool) {
+  if (pool == NULL) return;
+  Futex_Lock_Acquire(&memory_management_lock);
+  Pool_Destroy(pool);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+void *pool_get(struct Object_Pool *pool) {
+  void *object;
+
+  object = Pool_Get_Cached(pool);
+  if (object != NULL) return object;
+  Futex_Lock_Acquire(&memory_management_lock);
+  object = Pool_Get_Refill(pool);
+  Futex_Lock_Release(&memory_management_lock);
+  __memory_register_thread();
+  return object;
+}
+
+void pool_put(struct Object_Pool *pool, void *object) {
+  if (object == NULL) return;
+  if (Pool_Put_Cached(pool, object)) return;
+  Futex_Lock_Acquire(&memory_management_lock);
+  Pool_Put_Flush(pool, object);
+  Futex_Lock_Release(&memory_management_lock);
+  __memory_register_thread();
+}
+
+/* Hinted allocation. Without a lifetime or hot hint nothing changes,
+   so those requests keep the cache fast paths */
+
+void *malloc_hinted(size_t size, unsigned flags) {
+  void *ptr;
+
+  if ((flags & ~(MALLOC_HINT_SHORT_LIVED | MALLOC_HINT_LONG_LIVED | MALLOC_HINT_ZEROED | MALLOC_HINT_HOT)) ||
+      ((flags & MALLOC_HINT_SHORT_LIVED) && (flags & MALLOC_HINT_LONG_LIVED))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!(flags & (MALLOC_HINT_SHORT_LIVED | MALLOC_HINT_LONG_LIVED | MALLOC_HINT_HOT)))
+    return (flags & MALLOC_HINT_ZEROED) ? calloc(1, size) : malloc(size);
+
+  Futex_Lock_Acquire(&memory_management_lock);
+  ptr = __malloc_hinted_impl(size, flags);
+  Futex_Lock_Release(&memory_management_lock);
+  return ptr;
+}
+
+/* Reservations */
+
+int malloc_reserve(size_t bytes, unsigned flags) {
+  int result;
+
+  if (flags & ~(MALLOC_RESERVE_POPULATE | MALLOC_RESERVE_TOUCH)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (bytes == 0) return 0;
+  Futex_Lock_Acquire(&memory_management_lock);
+  result = __malloc_reserve_impl(bytes, flags);
+  Futex_Lock_Release(&memory_management_lock);
+  return result;
+}
+
+/* Introspection */
+
+static void __copy_lock_stats(struct malloc_lock_stats *stats) {
+  stats->acquisitions = memory_management_lock.acquisitions;
+  stats->contended_acquisitions = memory_management_lock.contended_acquisitions;
+  stats->wait_cycles = memory_management_lock.wait_cycles;
+}
+
+void malloc_lock_stats(struct malloc_lock_stats *stats) {
+  Futex_Lock_Acquire(&memory_management_lock);
+  __copy_lock_stats(stats);
+  Futex_Lock_Release(&memory_management_lock);
+}
+
+int malloc_trim(size_t pad) {
+  void *batch[CACHE_REFILL_BATCH];
+  size_t n, count;
+  int released;
+
+  /* Cached objects count as allocated and would keep their chunks alive */
+  while ((count = Cache_Drain_Local(batch, CACHE_REFILL_BATCH)) != 0) {
+    Futex_Lock_Acquire(&memory_management_lock);
+    for (n = 0; n < count; n++) __free_impl(batch[n]);
+    Futex_Lock_Release(&memory_management_lock);
+  }
+
+  Futex_Lock_Acquire(&memory_management_lock);
+  released = __malloc_trim_impl(pad);
+  Futex_Lock_Release(&memory_management_lock);
+  return released;
+}
+
+int malloc_walk(malloc_walk_callback callback, void *arg) {
+  int result;
+
+  Futex_Lock_Acquire(&memory_management_lock);
+  result = __malloc_walk_impl(callback, arg);
+  Futex_Lock_Release(&memory_management_lock);
+  return result;
+}
+
+int malloc_info(int options, FILE *fp) {
+  struct malloc_lock_stats stats;
+
+  if (fp == NULL || (options != MALLOC_INFO_XML && options != MALLOC_INFO_JSON)) {
+    errno = EINVAL;
+    return -1;
+  }
+  fflush(fp);
+  Futex_Lock_Acquire(&memory_management_lock);
+  __copy_lock_stats(&stats);
+  __malloc_info_impl(fileno(fp), options == MALLOC_INFO_JSON, &stats);
+  Futex_Lock_Release(&memory_management_lock);
+  return 0;
+}
+
+#ifdef MEMORY_TEST
+
+/* Builds into a program that runs on this allocator itself:
+
+   gcc -O0 -DDEBUG -DMEMORY_TEST -o memory_test memory.c implementation.c \
+     FreeBlockLList.c FreeBlockRecord.c FreeBlockIndex.c ChunkMap.c \
+     SmallCache.c ObjectPool.c FutexLock.c Trace.c util.c -lpthread
+*/
+
+#include "util.h"
+
+#define TEST_OBJECT_SIZE 32
+
+static int test_cpu;
+static void *test_fillers[CACHE_LIST_LIMIT];
+static void *test_refilled;
+static int test_refill_go, test_fill_go, test_fill_done;
+
+static void __test_pin() {
+  cpu_set_t one;
+
+  CPU_ZERO(&one);
+  CPU_SET(test_cpu, &one);
+  sched_setaffinity(0, sizeof(one), &one);
+}
+
+static void __test_wait_for(int *flag) {
+  while (!__atomic_load_n(flag, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static void *__test_refill_thread(void *unused) {
+  __test_pin();
+  __test_wait_for(&test_refill_go);
+  test_refilled = malloc(TEST_OBJECT_SIZE);
+  return NULL;
+}
+
+/* Only lock free frees until it says it is done: the heap lock is held */
+static void *__test_fill_thread(void *unused) {
+  size_t n;
+
+  __test_pin();
+  __test_wait_for(&test_fill_go);
+  for (n = 0; n < CACHE_LIST_LIMIT; n++) free(test_fillers[n]);
+  __atomic_store_n(&test_fill_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* A refill whose CPU list fills up from another thread while it waits
+   for the heap lock has to free its whole batch but the object it
+   returns. Both threads share one CPU, so they share the list */
+static void __test_refill_into_full_list() {
+  pthread_t refill, fill;
+  size_t n;
+
+  test_cpu = sched_getcpu();
+  __test_pin();
+  /* pthread_create allocates, so before anything holds the lock */
+  pthread_create(&refill, NULL, __test_refill_thread, NULL);
+  pthread_create(&fill, NULL, __test_fill_thread, NULL);
+  if (Cache_Set_Mode(CACHE_PERCPU) != CACHE_PERCPU) {
+    write_string(STDOUT_FILENO, "no rseq, refill test skipped\n", 100);
+    Cache_Set_Mode(CACHE_OFF);
+    __atomic_store_n(&test_refill_go, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&test_fill_go, 1, __ATOMIC_RELEASE);
+    pthread_join(refill, NULL);
+    pthread_join(fill, NULL);
+    free(test_refilled);
+    return;
+  }
+
+  /* Taken past the cache, so the class list starts out empty */
+  Futex_Lock_Acquire(&memory_management_lock);
+  for (n = 0; n < CACHE_LIST_LIMIT; n++) test_fillers[n] = __malloc_impl(TEST_OBJECT_SIZE);
+  __atomic_store_n(&test_refill_go, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&memory_management_lock.state, __ATOMIC_RELAXED) != 2) sched_yield();
+  __atomic_store_n(&test_fill_go, 1, __ATOMIC_RELEASE);
+  __test_wait_for(&test_fill_done);
+  Futex_Lock_Release(&memory_management_lock);
+  pthread_join(refill, NULL);
+  pthread_join(fill, NULL);
+
+  die_if_false(test_refilled != NULL, "refill test: malloc failed\n");
+  die_if_false(!(((struct FreeBlockRecord *) (test_refilled - FBR_HEADER_SIZE))->flags & FBR_FREE), "refill test: malloc returned a free block\n");
+  for (n = 0; n < CACHE_LIST_LIMIT; n++)
+    die_if_false(test_refilled != test_fillers[n], "refill test: malloc returned a cached object\n");
+  free(test_refilled);
+}
+
+/* Trimming walks every chunk and every reserve list */
+static void __test_trim_several_chunks() {
+  void *big[3];
+  size_t n;
+
+  die_if_false(malloc_reserve(1 << 20, 0) == 0, "trim test: malloc_reserve failed\n");
+  for (n = 0; n < 3; n++) {
+    big[n] = malloc(200000);    /* most of a default chunk each */
+    die_if_false(big[n] != NULL, "trim test: malloc failed\n");
+    memset(big[n], (int) n, 200000);
+  }
+  free(big[1]);
+  malloc_trim(0);
+  for (n = 0; n < 200000; n++)
+    die_if_false(((unsigned char *) big[0])[n] == 0 && ((unsigned char *) big[2])[n] == 2, "trim test: live block changed\n");
+  free(big[0]);
+  free(big[2]);
+  malloc_trim(0);
+}
+
+/* A grow that cannot be satisfied leaves the old block alone */
+static void __test_failed_realloc() {
+  unsigned char *old = malloc(100);
+  size_t n;
+
+  die_if_false(old != NULL, "realloc test: malloc failed\n");
+  memset(old, 0x5a, 100);
+  die_if_false(realloc(old, MAX_LLIST_SPACE + 1) == NULL && errno == ENOMEM, "realloc test: grow past a chunk did not fail\n");
+  for (n = 0; n < 100; n++)
+    die_if_false(old[n] == 0x5a, "realloc test: old block changed\n");
+  free(old);
+}
+
+int main() {
+  __test_refill_into_full_list();
+  __test_trim_several_chunks();
+  __test_failed_realloc();
+  write_string(STDOUT_FILENO, "memory test passed\n", 100);
+  return 0;
 }
 
+#endif
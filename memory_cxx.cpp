@@ -0,0 +1,75 @@
+/*
+    Replaceable C++ allocation functions for memory.so
+
+    Without these, every new goes through the operator new in
+    libstdc++, which calls malloc, which calls __malloc_impl, and
+    every sized delete drops the size the compiler handed it. These
+    call straight into memory.c instead, in every variant the
+    standard lets a program replace: plain, nothrow, sized and
+    std::align_val_t.
+
+    Compile with the rest of the library and link it with -lstdc++:
+
+    g++ -fPIC -Wall -O3 -c memory_cxx.cpp
+*/
+
+#include <cstddef>
+#include <new>
+
+extern "C" {
+  void *__memory_new(std::size_t size, std::size_t alignment);
+  void __memory_delete(void *ptr, std::size_t size);
+}
+
+/* new may not return NULL and must give distinct pointers even for
+   size 0, which __malloc_impl refuses */
+static void *__new_or_null(std::size_t size, std::size_t alignment) {
+  if (size == 0) size = 1;
+  for (;;) {
+    void *ptr = __memory_new(size, alignment);
+    if (ptr != nullptr) return ptr;
+    std::new_handler handler = std::get_new_handler();
+    if (handler == nullptr) return nullptr;
+    handler();
+  }
+}
+
+static void *__new_or_throw(std::size_t size, std::size_t alignment) {
+  void *ptr = __new_or_null(size, alignment);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+/* A handler that throws gets its exception swallowed here, as the
+   nothrow forms have to */
+static void *__new_nothrow(std::size_t size, std::size_t alignment) noexcept {
+  try {
+    return __new_or_null(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+void *operator new(std::size_t size) { return __new_or_throw(size, 0); }
+void *operator new[](std::size_t size) { return __new_or_throw(size, 0); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept { return __new_nothrow(size, 0); }
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept { return __new_nothrow(size, 0); }
+
+void *operator new(std::size_t size, std::align_val_t alignment) { return __new_or_throw(size, static_cast<std::size_t>(alignment)); }
+void *operator new[](std::size_t size, std::align_val_t alignment) { return __new_or_throw(size, static_cast<std::size_t>(alignment)); }
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return __new_nothrow(size, static_cast<std::size_t>(alignment)); }
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return __new_nothrow(size, static_cast<std::size_t>(alignment)); }
+
+void operator delete(void *ptr) noexcept { __memory_delete(ptr, 0); }
+void operator delete[](void *ptr) noexcept { __memory_delete(ptr, 0); }
+void operator delete(void *ptr, const std::nothrow_t &) noexcept { __memory_delete(ptr, 0); }
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept { __memory_delete(ptr, 0); }
+void operator delete(void *ptr, std::size_t size) noexcept { __memory_delete(ptr, size); }
+void operator delete[](void *ptr, std::size_t size) noexcept { __memory_delete(ptr, size); }
+
+void operator delete(void *ptr, std::align_val_t) noexcept { __memory_delete(ptr, 0); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { __memory_delete(ptr, 0); }
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { __memory_delete(ptr, 0); }
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept { __memory_delete(ptr, 0); }
+void operator delete(void *ptr, std::size_t size, std::align_val_t) noexcept { __memory_delete(ptr, size); }
+void operator delete[](void *ptr, std::size_t size, std::align_val_t) noexcept { __memory_delete(ptr, size); }
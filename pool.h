@@ -0,0 +1,27 @@
+/*
+    Fixed size object pools exported by memory.so
+
+    A pool hands out objects of one size and alignment. get and put
+    work on a per thread magazine and only take the heap lock when the
+    magazine runs empty or full. Objects from a pool must only be
+    returned to that pool with pool_put, never passed to free.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+struct Object_Pool;
+
+/* Returns NULL if size is 0 or larger than 64 KiB, alignment is not a
+   power of two no larger than 4096, or all 64 pools are in use */
+struct Object_Pool *pool_create(size_t size, size_t alignment);
+/* Releases every object of the pool at once. No thread may use the
+   pool or any of its objects afterwards */
+void pool_destroy(struct Object_Pool *pool);
+/* Returns NULL when out of memory */
+void *pool_get(struct Object_Pool *pool);
+void pool_put(struct Object_Pool *pool, void *object);
+
+#endif
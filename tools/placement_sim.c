@@ -0,0 +1,260 @@
+/*
+    Offline placement policy simulator
+
+    Replays an allocation trace against a single FreeBlockLList chunk
+    with each placement policy and reports how it behaved, so a policy
+    can be picked from measurements instead of guesses.
+
+    Compile from the repository root:
+
+    gcc -Wall -O2 -I. -o placement_sim tools/placement_sim.c FreeBlockLList.c FreeBlockRecord.c FreeBlockIndex.c util.c
+
+    Usage:
+
+    placement_sim [-p first_fit|next_fit|best_fit|good_fit|all] [-s chunk_bytes] [-r] [trace]
+
+    The trace is read from the named file or stdin, one operation per line:
+
+    a <id> <size>    allocate size bytes and remember the block as id
+    f <id>           free the block remembered as id
+
+    Blank lines and lines starting with # are skipped.
+
+    Sizes are rounded the way malloc rounds them. -r replays them
+    exactly as written instead.
+
+    avg frag and final frag are the share of the peak footprint taken
+    up by free holes, sampled every 1000 operations and at the end.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "FreeBlockLList.h"
+#include "FreeBlockRecord.h"
+#include "SmallCache.h"
+
+#define DEFAULT_SIM_CHUNK_SIZE (64UL << 20)
+#define FRAGMENTATION_SAMPLE_INTERVAL 1000
+
+struct Trace_Op
+{
+    char op;
+    size_t id;
+    size_t size;
+};
+
+struct Sim_Result
+{
+    size_t allocations;
+    size_t failures;
+    size_t total_steps;
+    size_t max_steps;
+    size_t live_bytes;
+    size_t peak_live_bytes;
+    size_t peak_footprint;          //highest byte ever handed out, measured from the start of the chunk
+    double fragmentation_sum;       //sum of sampled free bytes below peak_footprint / peak_footprint
+    size_t fragmentation_samples;
+    double final_fragmentation;
+};
+
+static bool Load_Trace(FILE *in, struct Trace_Op **ops_out, size_t *num_ops_out, size_t *max_id_out)
+{
+    char line[256];
+    size_t capacity = 1024, num_ops = 0, max_id = 0;
+    struct Trace_Op *ops = malloc(capacity * sizeof(*ops));
+    if(!ops) return false;
+
+    while(fgets(line, sizeof(line), in))
+    {
+        struct Trace_Op op = {0};
+        if(line[0] == '#' || line[0] == '\n') continue;
+        if(sscanf(line, " %c %zu %zu", &op.op, &op.id, &op.size) < 2 || (op.op != 'a' && op.op != 'f'))
+        {
+            fprintf(stderr, "Skipping malformed trace line: %s", line);
+            continue;
+        }
+        if(num_ops == capacity)
+        {
+            capacity *= 2;
+            struct Trace_Op *grown = realloc(ops, capacity * sizeof(*ops));
+            if(!grown) {free(ops); return false;}
+            ops = grown;
+        }
+        if(op.id > max_id) max_id = op.id;
+        ops[num_ops++] = op;
+    }
+
+    *ops_out = ops;
+    *num_ops_out = num_ops;
+    *max_id_out = max_id;
+    return true;
+}
+
+//Free bytes of a block that lie below footprint, which is measured from the start of the chunk
+static size_t Free_Bytes_Below(struct LListRecord *llist, struct FreeBlockRecord *record, size_t footprint)
+{
+    size_t start = (size_t) ((void *) record + FBR_HEADER_SIZE - (void *) llist);
+    size_t end = start + Get_Data_Size(record);
+    if(start >= footprint) return 0;
+    return (end < footprint ? end : footprint) - start;
+}
+
+//Fragmentation as the share of the footprint that is holes, pending unsorted blocks counted as they are.
+//The untouched space past the footprint is left out: it is one big block whatever the policy did
+static double Measure_Fragmentation(struct LListRecord *llist, size_t footprint)
+{
+    size_t holes = 0;
+    for(struct FreeBlockRecord *record = llist->head; record; record = Get_Next(record, llist))
+        holes += Free_Bytes_Below(llist, record, footprint);
+    for(struct FreeBlockRecord *record = llist->unsorted_head; record; record = Get_Next(record, llist))
+        holes += Free_Bytes_Below(llist, record, footprint);
+    return footprint ? (double) holes / footprint : 0.0;
+}
+
+//Place a block for a request of size as malloc would, or exactly as asked with raw
+static void *Place(struct LListRecord *llist, size_t size, bool raw)
+{
+    return Alloc_Mem_Chunk_Of_Size(llist, raw ? size : Round_Request_Size(size));
+}
+
+static bool Simulate(enum Placement_Policy policy, bool raw, const struct Trace_Op *ops, size_t num_ops, size_t max_id, size_t chunk_size, struct Sim_Result *result)
+{
+    struct LListRecord *llist = mmap(NULL, chunk_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    void **blocks = calloc(max_id + 1, sizeof(void *));
+    if(llist == MAP_FAILED || !blocks)
+    {
+        fprintf(stderr, "Cannot set up a %zu byte chunk\n", chunk_size);
+        if(llist != MAP_FAILED) munmap(llist, chunk_size);
+        free(blocks);
+        return false;
+    }
+
+    memset(result, 0, sizeof(*result));
+    Set_Placement_Policy(policy);
+    Init_LList(llist, chunk_size);
+
+    for(size_t n = 0; n < num_ops; n++)
+    {
+        const struct Trace_Op *op = &ops[n];
+        if(op->op == 'a')
+        {
+            if(blocks[op->id]) continue;    //id reused without a free, the trace is wrong but keep going
+            size_t steps_before = llist->search_steps;
+            void *mem = Place(llist, op->size ? op->size : 1, raw);
+            size_t steps = llist->search_steps - steps_before;
+
+            result->allocations++;
+            result->total_steps += steps;
+            if(steps > result->max_steps) result->max_steps = steps;
+            if(!mem) {result->failures++; continue;}
+
+            blocks[op->id] = mem;
+            size_t data_size = Get_Data_Size(mem - FBR_HEADER_SIZE);
+            size_t end = (size_t) (mem - (void *) llist) + data_size;
+            result->live_bytes += data_size;
+            if(result->live_bytes > result->peak_live_bytes) result->peak_live_bytes = result->live_bytes;
+            if(end > result->peak_footprint) result->peak_footprint = end;
+        }
+        else if(blocks[op->id])
+        {
+            result->live_bytes -= Get_Data_Size(blocks[op->id] - FBR_HEADER_SIZE);
+            Free_Mem_Chunk(llist, blocks[op->id]);
+            blocks[op->id] = NULL;
+        }
+
+        if(n % FRAGMENTATION_SAMPLE_INTERVAL == 0)
+        {
+            result->fragmentation_sum += Measure_Fragmentation(llist, result->peak_footprint);
+            result->fragmentation_samples++;
+        }
+    }
+
+    Flush_Unsorted_Blocks(llist);
+    result->final_fragmentation = Measure_Fragmentation(llist, result->peak_footprint);
+
+    munmap(llist, chunk_size);
+    free(blocks);
+    return true;
+}
+
+static void Print_Result(enum Placement_Policy policy, const struct Sim_Result *result)
+{
+    printf("%-10s allocs %10zu  failed %8zu  avg search %8.2f  max search %8zu  peak footprint %12zu  peak live %12zu  "
+           "overhead %6.3f  avg frag %5.3f  final frag %5.3f\n",
+           Placement_Policy_Name(policy),
+           result->allocations,
+           result->failures,
+           result->allocations ? (double) result->total_steps / result->allocations : 0.0,
+           result->max_steps,
+           result->peak_footprint,
+           result->peak_live_bytes,
+           result->peak_live_bytes ? (double) result->peak_footprint / result->peak_live_bytes : 0.0,
+           result->fragmentation_samples ? result->fragmentation_sum / result->fragmentation_samples : 0.0,
+           result->final_fragmentation);
+}
+
+int main(int argc, char **argv)
+{
+    const char *policy_name = "all";
+    const char *trace_path = NULL;
+    size_t chunk_size = DEFAULT_SIM_CHUNK_SIZE;
+    bool raw = false;
+
+    for(int n = 1; n < argc; n++)
+    {
+        if(!strcmp(argv[n], "-p") && n + 1 < argc) policy_name = argv[++n];
+        else if(!strcmp(argv[n], "-s") && n + 1 < argc) chunk_size = strtoull(argv[++n], NULL, 0);
+        else if(!strcmp(argv[n], "-r")) raw = true;
+        else if(argv[n][0] != '-' && !trace_path) trace_path = argv[n];
+        else
+        {
+            fprintf(stderr, "usage: %s [-p first_fit|next_fit|best_fit|good_fit|all] [-s chunk_bytes] [-r] [trace]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    enum Placement_Policy first = FIRST_FIT, last = GOOD_FIT;
+    if(strcmp(policy_name, "all"))
+    {
+        if(!Parse_Placement_Policy(policy_name, &first))
+        {
+            fprintf(stderr, "Unknown placement policy %s\n", policy_name);
+            return 2;
+        }
+        last = first;
+    }
+    if(chunk_size < MIN_LLIST_SPACE + sizeof(struct FreeBlockRecord) || chunk_size > MAX_LLIST_SPACE)
+    {
+        fprintf(stderr, "Chunk size %zu is out of range\n", chunk_size);
+        return 2;
+    }
+
+    FILE *in = trace_path ? fopen(trace_path, "r") : stdin;
+    if(!in)
+    {
+        perror(trace_path);
+        return 1;
+    }
+
+    struct Trace_Op *ops;
+    size_t num_ops, max_id;
+    bool loaded = Load_Trace(in, &ops, &num_ops, &max_id);
+    if(in != stdin) fclose(in);
+    if(!loaded)
+    {
+        fprintf(stderr, "Out of memory reading the trace\n");
+        return 1;
+    }
+
+    for(int policy = first; policy <= last; policy++)
+    {
+        struct Sim_Result result;
+        if(!Simulate(policy, raw, ops, num_ops, max_id, chunk_size, &result)) {free(ops); return 1;}
+        Print_Result(policy, &result);
+    }
+
+    free(ops);
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+    Trace ring decoder
+
+    Prints the events recorded by a memory.so built with -DMALLOC_TRACE,
+    oldest first. Every thread leaves a ring file named
+    malloc-trace.<pid>.<tid> in $MALLOC_TRACE_DIR, or /tmp if that is not
+    set. A ring keeps the last 65536 events of its thread.
+
+    Compile from the repository root:
+
+    gcc -Wall -O2 -I. -o trace_decode tools/trace_decode.c
+
+    Usage:
+
+    trace_decode [-s] ring_file...
+
+    Each line is the thread id, the cycle counter relative to the first
+    event printed from that file, the event and its two arguments. -s
+    prints a count per event type for each file instead.
+*/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Trace.h"
+
+static const char *event_names[TRACE_NUM_EVENT_TYPES] =
+{
+    [TRACE_CHUNK_MAP] = "chunk_map",
+    [TRACE_CHUNK_UNMAP] = "chunk_unmap",
+    [TRACE_SPLIT] = "split",
+    [TRACE_COALESCE] = "coalesce",
+    [TRACE_PURGE] = "purge",
+    [TRACE_LOCK_CONTENDED] = "lock_contended",
+    [TRACE_FREE_UNKNOWN] = "free_unknown",
+};
+
+static bool Decode_Ring(const char *path, bool summary)
+{
+    FILE *in = fopen(path, "rb");
+    if(!in)
+    {
+        perror(path);
+        return false;
+    }
+
+    struct Trace_Ring_Header header;
+    if(fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC)
+    {
+        fprintf(stderr, "%s is not a trace ring\n", path);
+        fclose(in);
+        return false;
+    }
+    if(header.version != TRACE_VERSION || header.capacity == 0)
+    {
+        fprintf(stderr, "%s: unsupported trace version %u\n", path, header.version);
+        fclose(in);
+        return false;
+    }
+
+    struct Trace_Event *events = malloc(header.capacity * sizeof(struct Trace_Event));
+    if(!events || fread(events, sizeof(struct Trace_Event), header.capacity, in) != header.capacity)
+    {
+        fprintf(stderr, "%s: truncated ring\n", path);
+        free(events);
+        fclose(in);
+        return false;
+    }
+    fclose(in);
+
+    uint64_t first = header.written > header.capacity ? header.written - header.capacity : 0;
+    uint64_t counts[TRACE_NUM_EVENT_TYPES] = {0}, unknown = 0;
+    uint64_t base = events[first % header.capacity].cycles;
+
+    if(first) fprintf(stderr, "%s: the oldest %llu events were overwritten\n", path, (unsigned long long) first);
+    for(uint64_t n = first; n < header.written; n++)
+    {
+        const struct Trace_Event *event = &events[n % header.capacity];
+        bool known = event->type < TRACE_NUM_EVENT_TYPES && event_names[event->type];
+        if(summary)
+        {
+            if(known) counts[event->type]++;
+            else unknown++;
+            continue;
+        }
+        printf("%llu %12llu %-15s 0x%llx %llu\n",
+               (unsigned long long) header.tid,
+               (unsigned long long) (event->cycles - base),
+               known ? event_names[event->type] : "unknown",
+               (unsigned long long) event->a,
+               (unsigned long long) event->b);
+    }
+
+    if(summary)
+    {
+        printf("%s: pid %llu tid %llu, %llu events\n", path, (unsigned long long) header.pid, (unsigned long long) header.tid, (unsigned long long) header.written);
+        for(int type = 1; type < TRACE_NUM_EVENT_TYPES; type++)
+            printf("  %-15s %llu\n", event_names[type], (unsigned long long) counts[type]);
+        if(unknown) printf("  %-15s %llu\n", "unknown", (unsigned long long) unknown);
+    }
+
+    free(events);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bool summary = false;
+    int n = 1;
+
+    if(n < argc && !strcmp(argv[n], "-s"))
+    {
+        summary = true;
+        n++;
+    }
+    if(n == argc)
+    {
+        fprintf(stderr, "usage: %s [-s] ring_file...\n", argv[0]);
+        return 2;
+    }
+
+    int status = 0;
+    for(; n < argc; n++)
+        if(!Decode_Ring(argv[n], summary)) status = 1;
+    return status;
+}
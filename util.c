@@ -5,6 +5,9 @@
 #include <stdarg.h>
 #include "util.h"
 
+//The one out of line copy, for calls the compiler does not inline
+extern inline void die_if_false(bool condition, const char *error);
+
 bool open_file(const char *path, int oflag, int *fd_out)
 {
 	int ret_value = open(path, oflag, 0666);
@@ -107,7 +110,8 @@ void convert_integer(char *str, long n, int base, int min_length) {
 
     char tmp[100];
 
-    int i, r, k;
+    long r;
+    int i, k;
     if (n == 0) {
         str[0] = '0';
         str[1] = '\0';
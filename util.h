@@ -10,6 +10,9 @@
 //On error, any output vars are not modified
 //Most of these are just wrappers around the system calls
 
+//Writes a string to a file, with no_longer_than being a safety incase the null terminator is missing
+bool write_string(int fd, const char *s, size_t no_longer_than);
+
 //assert clone, but accepts an optional error string
 inline void die_if_false(bool condition, const char *error)
 {
@@ -32,8 +35,6 @@ bool seek_file(int fd, off_t offset, int whence, off_t *actual_offset_out);
 bool read_file(int fd, void *buffer, size_t num_bytes, ssize_t *num_bytes_read);
 //Writes raw bytes to a file
 bool write_file(int fd, void *buffer, size_t size);
-//Writes a string to a file, with no_longer_than being a safety incase the null terminator is missing
-bool write_string(int fd, const char *s, size_t no_longer_than);
 void convert_integer(char *str, long n, int base, int min_length);
 //As above, but writes num_strings in one call
 bool write_strings(int fd, size_t no_longer_than, int num_strings, ...);